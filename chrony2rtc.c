@@ -34,6 +34,8 @@
 #define PKT_TYPE_CMD_REPLY 2
 #define FLOAT_EXP_BITS 7
 #define FLOAT_COEF_BITS ((((int)sizeof(int32_t))<<3)-FLOAT_EXP_BITS)
+#define LEAP_UNSYNCHRONISED 3
+#define WAITSYNC_INTERVAL 6
 
 typedef struct
 {
@@ -176,6 +178,9 @@ static int getdata(int s,int *strt,double *corr,double *skew)
 		ans.version!=PROTO_VERSION_NUMBER||ans.sequence!=req.sequence||
 		ans.status||be16toh(ans.reply)!=RPY_TRACKING)return -1;
 
+	if(!ans.ref_id||be16toh(ans.leap_status)==LEAP_UNSYNCHRONISED)
+		return -1;
+
 	*strt=be16toh(ans.stratum);
 	*corr=fabs(fntoh(ans.current_correction));
 	*skew=fntoh(ans.skew_ppm);
@@ -196,7 +201,13 @@ static void usage(void)
 		"/run/chrony/chronyd.sock\n"
 		"-T <rtctool-pathname>  rtctool pathname, default "
 			"/sbin/rtctool\n"
-		"-d                     daemonize\n");
+		"-O <usec>              only write the RTC if its offset "
+		"exceeds this value\n"
+		"-d                     daemonize\n"
+		"-w <tries>             one-shot mode, wait up to <tries> times 6 "
+		"seconds for\n"
+		"                       the checks to pass, update the RTC and "
+		"exit\n");
 	exit(1);
 }
 
@@ -206,6 +217,7 @@ int main(int argc,char *argv[])
 	int err=1;
 	int s=-1;
 	int dmn=0;
+	int tries=0;
 	int tfd;
 	int sfd;
 	int sts;
@@ -219,11 +231,12 @@ int main(int argc,char *argv[])
 	uint64_t v;
 	char *sock=SOCKET;
 	char *tool=RTCTOOL;
+	char *gate=NULL;
 	struct pollfd pp[2];
 	struct itimerspec it;
 	sigset_t set;
 
-	while((c=getopt(argc,argv,"s:c:S:C:Td"))!=-1)switch(c)
+	while((c=getopt(argc,argv,"s:c:S:C:T:O:dw:"))!=-1)switch(c)
 	{
 	case 's':
 		if((cmpstrat=atoi(optarg))<=0||cmpstrat>=16)usage();
@@ -245,15 +258,44 @@ int main(int argc,char *argv[])
 		tool=optarg;
 		break;
 
+	case 'O':
+		if(atoi(optarg)<1||atoi(optarg)>1000000)usage();
+		gate=optarg;
+		break;
+
 	case 'd':
 		dmn=1;
 		break;
 
+	case 'w':
+		if((tries=atoi(optarg))<1||tries>10000)usage();
+		break;
+
 	default:usage();
 		break;
 	}
 
 	if(!cmpstrat||!cmpcorr||!cmpskew)usage();
+	if(dmn&&tries)usage();
+
+	while(tries--)
+	{
+		if((s=doconn(sock))!=-1)
+		{
+			c=getdata(s,&stratum,&correction,&skew);
+			dodisc(s);
+			if(!c&&stratum<cmpstrat&&correction<cmpcorr&&
+				skew<cmpskew)
+			{
+				if(gate)execl(tool,tool,"-s","-O",gate,NULL);
+				else execl(tool,tool,"-s",NULL);
+				perror("execl");
+				return 1;
+			}
+		}
+		if(tries)sleep(WAITSYNC_INTERVAL);
+		else return 1;
+	}
 
 	if((tfd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC|TFD_NONBLOCK))==-1)
 	{
@@ -321,7 +363,8 @@ int main(int argc,char *argv[])
 		switch(fork())
 		{
 		case -1:continue;
-		case 0:	return execl(tool,tool,"-s",NULL);
+		case 0:	if(gate)return execl(tool,tool,"-s","-O",gate,NULL);
+			return execl(tool,tool,"-s",NULL);
 		default:if(wait(&sts)==-1||sts)continue;
 			break;
 		}
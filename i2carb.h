@@ -0,0 +1,184 @@
+/*
+ * i2carb.h
+ *
+ * by Andreas Steinmetz, 2020
+ *
+ * This source is put in the public domain. Have fun!
+ */
+
+#ifndef I2CARB_H_INCLUDED
+#define I2CARB_H_INCLUDED
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+
+/*
+ * Cross process I2C bus arbitration.
+ *
+ * Every transaction is done while holding an exclusive flock() on the
+ * /dev/i2c-N file descriptor, so all processes serialize on the bus.
+ *
+ * A PPS daemon publishes the time of every PPS edge of the bus in
+ * I2CARB_FILE. Bulk transactions are then moved out of the quiet window
+ * from I2CARB_PRE before to I2CARB_POST after the edge, so that the time
+ * critical transactions right after the edge always find an idle bus.
+ * Without a recently published edge bulk transactions are not delayed.
+ *
+ * Any failure degrades to no arbitration, the bus access itself is never
+ * prevented.
+ */
+
+#define I2CARB_FILE	"/run/i2carb.%d"
+#define I2CARB_MAGIC	0x49324341
+#define I2CARB_PRE	5000000
+#define I2CARB_POST	20000000
+#define I2CARB_STALE	2
+#define I2CARB_BUSSES	256
+
+/* transaction priorities */
+
+#define I2CARB_BULK	0
+#define I2CARB_CRIT	1
+
+struct i2carbshm
+{
+	uint32_t magic;
+	uint32_t seq;
+	int64_t sec;
+	int64_t nsec;
+};
+
+/* bus number of an open /dev/i2c-N file descriptor */
+
+static inline int i2carb_bus(int i2cfd)
+{
+	struct stat stb;
+
+	if(fstat(i2cfd,&stb)||!S_ISCHR(stb.st_mode))return -1;
+	if(minor(stb.st_rdev)>=I2CARB_BUSSES)return -1;
+	return minor(stb.st_rdev);
+}
+
+/* map the edge time file of the bus, returns NULL if not available */
+
+static inline struct i2carbshm *i2carb_map(int bus,int publish)
+{
+	static struct i2carbshm *map[I2CARB_BUSSES];
+	int fd;
+	struct i2carbshm *s;
+	char bfr[32];
+
+	if(bus<0||bus>=I2CARB_BUSSES)return NULL;
+	if(map[bus])return map[bus];
+	snprintf(bfr,sizeof(bfr),I2CARB_FILE,bus);
+	if(publish)
+	{
+		if((fd=open(bfr,O_RDWR|O_CREAT|O_CLOEXEC,0644))==-1)goto err1;
+		if(ftruncate(fd,sizeof(struct i2carbshm)))goto err2;
+	}
+	else if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)goto err1;
+	if((s=mmap(NULL,sizeof(struct i2carbshm),
+		publish?PROT_READ|PROT_WRITE:PROT_READ,MAP_SHARED,fd,0))==
+		MAP_FAILED)goto err2;
+	close(fd);
+	if(publish)__atomic_store_n(&s->magic,I2CARB_MAGIC,__ATOMIC_RELEASE);
+	else if(__atomic_load_n(&s->magic,__ATOMIC_ACQUIRE)!=I2CARB_MAGIC)
+	{
+		munmap(s,sizeof(struct i2carbshm));
+		goto err1;
+	}
+	map[bus]=s;
+	return s;
+
+err2:	close(fd);
+err1:	return NULL;
+}
+
+/* publish the time of a PPS edge, called by the PPS daemon */
+
+static inline void i2carb_edge(int bus,struct timespec *edge)
+{
+	struct i2carbshm *s;
+	uint32_t seq;
+
+	if(!(s=i2carb_map(bus,1)))return;
+	seq=s->seq;
+	__atomic_store_n(&s->seq,seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&s->sec,edge->tv_sec,__ATOMIC_RELAXED);
+	__atomic_store_n(&s->nsec,edge->tv_nsec,__ATOMIC_RELAXED);
+	__atomic_store_n(&s->seq,seq+2,__ATOMIC_RELEASE);
+}
+
+/* nanoseconds until the quiet window of the bus ends, 0 if outside */
+
+static inline long i2carb_quiet(int bus)
+{
+	int i;
+	uint32_t seq;
+	int64_t sec;
+	int64_t nsec;
+	long long d;
+	struct i2carbshm *s;
+	struct timespec now;
+
+	if(!(s=i2carb_map(bus,0)))return 0;
+	for(i=0;i<16;i++)
+	{
+		seq=__atomic_load_n(&s->seq,__ATOMIC_ACQUIRE);
+		sec=__atomic_load_n(&s->sec,__ATOMIC_RELAXED);
+		nsec=__atomic_load_n(&s->nsec,__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(!(seq&1)&&seq==__atomic_load_n(&s->seq,__ATOMIC_RELAXED))
+			break;
+	}
+	if(i==16||!seq)return 0;
+	if(clock_gettime(CLOCK_REALTIME,&now))return 0;
+	d=(now.tv_sec-sec)*1000000000LL+now.tv_nsec-nsec;
+	if(d<0||d>I2CARB_STALE*1000000000LL)return 0;
+	d%=1000000000;
+	if(d<I2CARB_POST)return I2CARB_POST-d;
+	if(d>1000000000-I2CARB_PRE)return 1000000000-d+I2CARB_POST;
+	return 0;
+}
+
+/* lock the bus for a transaction of the given priority */
+
+static inline void i2carb_lock(int i2cfd,int prio)
+{
+	int bus;
+	long ns;
+	struct timespec ts;
+
+	bus=(prio==I2CARB_BULK)?i2carb_bus(i2cfd):-1;
+
+	while(1)
+	{
+		if(bus!=-1)while((ns=i2carb_quiet(bus)))
+		{
+			ts.tv_sec=0;
+			ts.tv_nsec=ns;
+			nanosleep(&ts,NULL);
+		}
+		while(flock(i2cfd,LOCK_EX))if(errno!=EINTR)return;
+		if(bus==-1||!i2carb_quiet(bus))return;
+		flock(i2cfd,LOCK_UN);
+	}
+}
+
+/* unlock the bus after a transaction */
+
+static inline void i2carb_unlock(int i2cfd)
+{
+	flock(i2cfd,LOCK_UN);
+}
+
+#endif
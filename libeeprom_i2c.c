@@ -15,6 +15,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "eeprom_i2c.h"
+#include "i2carb.h"
 
 int eeprom_i2c_open(int i2cbus)
 {
@@ -45,6 +46,7 @@ int eeprom_i2c_close(int i2cfd)
 int eeprom_i2c_page_read(int i2cfd,unsigned char i2caddr,
 	unsigned int memaddr,unsigned char *data,int len)
 {
+	int r;
 	struct i2c_rdwr_ioctl_data rdwr;
 	struct i2c_msg msg[2];
 	unsigned char bfr[2];
@@ -67,12 +69,17 @@ int eeprom_i2c_page_read(int i2cfd,unsigned char i2caddr,
 	msg[1].buf=data;
 	msg[1].len=len;
 
-	return ioctl(i2cfd,I2C_RDWR,&rdwr)==2?0:-1;
+	i2carb_lock(i2cfd,I2CARB_BULK);
+	r=ioctl(i2cfd,I2C_RDWR,&rdwr);
+	i2carb_unlock(i2cfd);
+
+	return r==2?0:-1;
 }
 
 int eeprom_i2c_page_write(int i2cfd,unsigned char i2caddr,
 	unsigned int memaddr,unsigned char *data,int len)
 {
+	int r;
 	struct i2c_rdwr_ioctl_data rdwr;
 	struct i2c_msg msg;
 	unsigned char bfr[34];
@@ -91,11 +98,16 @@ int eeprom_i2c_page_write(int i2cfd,unsigned char i2caddr,
 	msg.buf=bfr;
 	msg.len=len+2;
 
-	return ioctl(i2cfd,I2C_RDWR,&rdwr)==1?0:-1;
+	i2carb_lock(i2cfd,I2CARB_BULK);
+	r=ioctl(i2cfd,I2C_RDWR,&rdwr);
+	i2carb_unlock(i2cfd);
+
+	return r==1?0:-1;
 }
 
 int eeprom_i2c_busy(int i2cfd,unsigned char i2caddr)
 {
+	int r;
 	struct i2c_rdwr_ioctl_data rdwr;
 	struct i2c_msg msg;
 
@@ -107,7 +119,11 @@ int eeprom_i2c_busy(int i2cfd,unsigned char i2caddr)
 	msg.buf=NULL;
 	msg.len=0;
 
-	return ioctl(i2cfd,I2C_RDWR,&rdwr)==1?0:-1;
+	i2carb_lock(i2cfd,I2CARB_BULK);
+	r=ioctl(i2cfd,I2C_RDWR,&rdwr);
+	i2carb_unlock(i2cfd);
+
+	return r==1?0:-1;
 }
 
 int eeprom_i2c_read(int i2cfd,unsigned char i2caddr,
@@ -0,0 +1,382 @@
+/*
+ * rtcageing.c
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include "rtcest.h"
+
+/*
+ * Offline ageing calibration from chrony logs.
+ *
+ * The ageing history written by "rtctool -A" and "-e" tells which ageing
+ * value was active when. Samples taken while "-e" or "-E" stepped the
+ * ageing value (from an AGE_SWEEP line to the next line) are ignored. The logs are streamed line by line, so memory use does not
+ * depend on their length. Both refclocks.log and statistics.log of chrony
+ * are accepted, lines are told apart by their number of fields:
+ *
+ * refclocks.log: the raw offset (RTC minus system time) of every sample
+ * is fitted linearly over one hour bins, the slope is the RTC frequency
+ * error. A bin is restarted on a gap or on an offset jump as caused by
+ * an RTC write.
+ *
+ * statistics.log: the "Diff freq" estimate of chrony is averaged over one
+ * hour bins.
+ *
+ * Either way the bins are the independent frequency samples of a period.
+ * The system clock must be synchronized to a good source during the
+ * logged time (the RTC should be "noselect"). Across periods the
+ * frequency is fitted linearly to the ageing value, with only one ageing
+ * value the mean of the sensitivity table measured by "rtctool -E" or,
+ * without table, the nominal sensitivity is used instead.
+ */
+
+#define AGEFILE		"/var/lib/rtctool/ageing.%d"
+#define AGE_SWEEP	128
+#define SENSFILE	"/var/lib/rtctool/sens.%d"
+#define MAXPERIOD	256
+#define BIN		3600
+#define BIN_MIN		60
+#define SETTLE		600
+#define GAP		600
+#define JUMP		2e-4
+#define AGE_SENS	-0.1
+#define VAR_MIN		1e-6
+
+struct period
+{
+	time_t when;
+	int ageing;
+	unsigned long bins;
+	double mean;
+	double m2;
+};
+
+struct bin
+{
+	int period;
+	int n;
+	double start;
+	double last;
+	double prev;
+	double sum;
+	struct linfit fit;
+};
+
+static struct period p[MAXPERIOD];
+static int np;
+
+static int loadhist(char *fn)
+{
+	int v;
+	long long w;
+	FILE *fp;
+
+	if(!(fp=fopen(fn,"re")))return -1;
+	while(np<MAXPERIOD&&fscanf(fp,"%lld %d",&w,&v)==2)
+	{
+		if(np&&w<p[np-1].when)
+		{
+			fclose(fp);
+			return -1;
+		}
+		memset(&p[np],0,sizeof(struct period));
+		p[np].when=w;
+		p[np++].ageing=v;
+	}
+	fclose(fp);
+	return np?0:-1;
+}
+
+static int loadsens(int bus,double *sens)
+{
+	int n=0;
+	int temp;
+	double v;
+	double sum=0;
+	FILE *fp;
+	char bfr[64];
+
+	snprintf(bfr,sizeof(bfr),SENSFILE,bus);
+	if(!(fp=fopen(bfr,"re")))return -1;
+	while(fscanf(fp,"%d %lf",&temp,&v)==2&&v<0)
+	{
+		sum+=v;
+		n++;
+	}
+	fclose(fp);
+	if(!n)return -1;
+	*sens=sum/n;
+	return 0;
+}
+
+static int findperiod(time_t t)
+{
+	int i;
+
+	for(i=np-1;i>=0;i--)if(p[i].when<=t)return i;
+	return -1;
+}
+
+/* close a bin and add its frequency (ppm) to the period statistics */
+
+static void binclose(struct bin *b,int stats)
+{
+	double f;
+	double d;
+	struct period *q;
+
+	if(b->period==-1)return;
+	if(stats)
+	{
+		if(!b->n)goto out;
+		f=b->sum/b->n;
+	}
+	else
+	{
+		if(b->fit.n<BIN_MIN||linfit_slope(&b->fit,&f))goto out;
+		f*=1e6;
+	}
+
+	q=&p[b->period];
+	q->bins++;
+	d=f-q->mean;
+	q->mean+=d/q->bins;
+	q->m2+=d*(f-q->mean);
+
+out:	b->period=-1;
+}
+
+static void binstart(struct bin *b,int period,double t)
+{
+	b->period=period;
+	b->start=t;
+	b->n=0;
+	b->sum=0;
+	linfit_init(&b->fit);
+}
+
+/* date and time fields of a chrony log line to seconds since the epoch */
+
+static int logtime(char *date,char *tim,double *t)
+{
+	int sec;
+	double frac;
+	char *end;
+	struct tm tm;
+
+	memset(&tm,0,sizeof(tm));
+	if(!(end=strptime(date,"%Y-%m-%d",&tm))||*end)return -1;
+	if(!(end=strptime(tim,"%H:%M:%S",&tm)))return -1;
+	frac=0;
+	if(*end=='.')frac=strtod(end,&end);
+	if(*end)return -1;
+	sec=tm.tm_sec;
+	tm.tm_sec=0;
+	*t=(double)timegm(&tm)+sec+frac;
+	return 0;
+}
+
+static int process(FILE *fp,char *refid,struct bin *rb,struct bin *sb,
+	unsigned long *used)
+{
+	int n;
+	int i;
+	double t;
+	double v;
+	char *f[16];
+	char *end;
+	char *save;
+	char line[512];
+
+	while(fgets(line,sizeof(line),fp))
+	{
+		for(n=0,f[0]=strtok_r(line," \t\r\n",&save);f[n]&&n<15;
+			f[++n]=strtok_r(NULL," \t\r\n",&save));
+		if(n!=9&&n<12)continue;
+		if(strcmp(f[2],refid)||logtime(f[0],f[1],&t))continue;
+		if((i=findperiod((time_t)t))==-1||p[i].ageing==AGE_SWEEP||
+			t<p[i].when+SETTLE)continue;
+		if(n==9)
+		{
+			v=strtod(f[6],&end);
+			if(*end)continue;
+			if(rb->period!=i||t-rb->last>GAP||
+				fabs(v-rb->prev)>JUMP||t>=rb->start+BIN)
+			{
+				binclose(rb,0);
+				binstart(rb,i,t);
+			}
+			linfit_add(&rb->fit,t-rb->start,v);
+			rb->last=t;
+			rb->prev=v;
+		}
+		else
+		{
+			v=strtod(f[6],&end);
+			if(*end)continue;
+			if(sb->period!=i||t>=sb->start+BIN)
+			{
+				binclose(sb,1);
+				binstart(sb,i,t);
+			}
+			sb->sum+=v;
+			sb->n++;
+		}
+		(*used)++;
+	}
+
+	return ferror(fp)?-1:0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"Usage: rtcageing [<options>] <chrony log>...\n"
+		"-i <i2cid>  i2c bus of the ageing history, default 1\n"
+		"-a <file>   ageing history, default "
+		"/var/lib/rtctool/ageing.<i2cid>\n"
+		"-r <refid>  refid of the RTC refclock, default RTC\n"
+		"Logs are refclocks.log or statistics.log of chrony in "
+		"chronological order,\n\"-\" reads from stdin.\n");
+	exit(1);
+}
+
+int main(int argc,char *argv[])
+{
+	int c;
+	int i;
+	int bus=1;
+	int val;
+	int distinct=0;
+	unsigned long used=0;
+	double w;
+	double sw=0;
+	double sx=0;
+	double sy=0;
+	double sxx=0;
+	double sxy=0;
+	double det;
+	double slope;
+	double icpt;
+	double best;
+	double err;
+	char *hist=NULL;
+	char *refid="RTC";
+	FILE *fp;
+	struct bin rb;
+	struct bin sb;
+	char bfr[64];
+
+	while((c=getopt(argc,argv,"i:a:r:"))!=-1)switch(c)
+	{
+	case 'i':
+		bus=atoi(optarg);
+		if(bus<0||bus>255)usage();
+		break;
+
+	case 'a':
+		hist=optarg;
+		break;
+
+	case 'r':
+		refid=optarg;
+		break;
+
+	default:usage();
+	}
+	if(optind==argc)usage();
+
+	if(!hist)
+	{
+		snprintf(bfr,sizeof(bfr),AGEFILE,bus);
+		hist=bfr;
+	}
+	if(loadhist(hist))
+	{
+		fprintf(stderr,"Can't read ageing history %s.\n",hist);
+		return 1;
+	}
+
+	rb.period=-1;
+	sb.period=-1;
+	for(i=optind;i<argc;i++)
+	{
+		if(!strcmp(argv[i],"-"))fp=stdin;
+		else if(!(fp=fopen(argv[i],"re")))
+		{
+			fprintf(stderr,"Can't open %s.\n",argv[i]);
+			return 1;
+		}
+		if(process(fp,refid,&rb,&sb,&used))
+		{
+			fprintf(stderr,"Can't read %s.\n",argv[i]);
+			return 1;
+		}
+		if(fp!=stdin)fclose(fp);
+	}
+	binclose(&rb,0);
+	binclose(&sb,1);
+
+	printf("%lu samples used\n",used);
+	for(i=0;i<np;i++)
+	{
+		if(p[i].bins<2)continue;
+		err=sqrt(fmax(p[i].m2/(p[i].bins-1),VAR_MIN)/p[i].bins);
+		printf("ageing %+4d since %lld: %+.4fppm +/- %.4fppm "
+			"(%lu hours)\n",p[i].ageing,(long long)p[i].when,
+			p[i].mean,err,p[i].bins);
+		for(c=0;c<i;c++)if(p[c].bins>=2&&p[c].ageing==p[i].ageing)
+			break;
+		if(c==i)distinct++;
+		w=1/(err*err);
+		sw+=w;
+		sx+=w*p[i].ageing;
+		sy+=w*p[i].mean;
+		sxx+=w*p[i].ageing*p[i].ageing;
+		sxy+=w*p[i].ageing*p[i].mean;
+	}
+	if(!sw)
+	{
+		fprintf(stderr,"Not enough data, need at least two hours of "
+			"samples.\n");
+		return 1;
+	}
+
+	det=sw*sxx-sx*sx;
+	if(distinct>1&&det>0&&(slope=(sw*sxy-sx*sy)/det)<0)
+	{
+		icpt=(sy-slope*sx)/sw;
+		best=-icpt/slope;
+		err=sqrt((sxx-2*best*sx+best*best*sw)/det)/-slope;
+		printf("Measured sensitivity: %.4fppm per step\n",slope);
+	}
+	else
+	{
+		if(!loadsens(bus,&slope))
+			printf("Module sensitivity: %.4fppm per step\n",slope);
+		else
+		{
+			slope=AGE_SENS;
+			printf("Nominal sensitivity: %.4fppm per step\n",
+				slope);
+		}
+		best=sx/sw-sy/sw/slope;
+		err=sqrt(1/sw)/-slope;
+	}
+
+	val=(int)floor(best+0.5);
+	if(val<-127)val=-127;
+	if(val>127)val=127;
+	printf("Optimal ageing value: %d (%.1f, 95%% confidence %.1f to "
+		"%.1f)\n",val,best,best-1.96*err,best+1.96*err);
+	return 0;
+}
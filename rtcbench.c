@@ -0,0 +1,173 @@
+/*
+ * rtcbench.c
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include "rtccodec.h"
+
+#define LOOPS 10000000
+
+/* the struct tm based conversion previously used by rtctool */
+
+static int olddecode(unsigned char *i2cdatim,time_t *t)
+{
+	struct tm datim;
+
+	if(i2cdatim[2]&0x40)return -1;
+
+	datim.tm_sec=(i2cdatim[0]&0xf)+10*(i2cdatim[0]>>4);
+	datim.tm_min=(i2cdatim[1]&0xf)+10*(i2cdatim[1]>>4);
+	datim.tm_hour=(i2cdatim[2]&0xf)+10*(i2cdatim[2]>>4);
+	datim.tm_wday=i2cdatim[3]-1;
+	datim.tm_mday=(i2cdatim[4]&0xf)+10*(i2cdatim[4]>>4);
+	datim.tm_mon=(i2cdatim[5]&0xf)+10*((i2cdatim[5]&0x7f)>>4)-1;
+	datim.tm_year=(i2cdatim[6]&0xf)+10*(i2cdatim[6]>>4)+100;
+	datim.tm_yday=0;
+	datim.tm_isdst=0;
+	if((*t=timegm(&datim))==(time_t)(-1))return -1;
+	return 0;
+}
+
+static int oldencode(time_t t,unsigned char *i2cdatim)
+{
+	int val;
+	struct tm datim;
+
+	gmtime_r(&t,&datim);
+	if(datim.tm_min>59||datim.tm_year<100||datim.tm_year>199)return -1;
+
+	i2cdatim[0]=(datim.tm_sec%10)+((datim.tm_sec/10)<<4);
+	i2cdatim[1]=(datim.tm_min%10)+((datim.tm_min/10)<<4);
+	i2cdatim[2]=(datim.tm_hour%10)+((datim.tm_hour/10)<<4);
+	i2cdatim[3]=datim.tm_wday+1;
+	i2cdatim[4]=(datim.tm_mday%10)+((datim.tm_mday/10)<<4);
+	val=datim.tm_mon+1;
+	i2cdatim[5]=(val%10)+((val/10)<<4);
+	val=datim.tm_year-100;
+	i2cdatim[6]=(val%10)+((val/10)<<4);
+	return 0;
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	return ((t1.tv_sec-t0->tv_sec)*1e9+t1.tv_nsec-t0->tv_nsec)/LOOPS;
+}
+
+/* compare both implementations over the whole DS3231 range */
+
+static int verify(void)
+{
+	int i;
+	time_t t;
+	time_t t1;
+	time_t t2;
+	unsigned char r1[7];
+	unsigned char r2[7];
+
+	for(t=(time_t)RTC_DAY2000*86400;t<(time_t)(RTC_DAY2000+36525)*86400;
+		t+=86400)for(i=0;i<3;i++)
+	{
+		t1=t+(i==2?86399:i*43200+(t/86400)%3600);
+		if(oldencode(t1,r1)||rtc_encode(t1,r2)||memcmp(r1,r2,7))
+		{
+			fprintf(stderr,"encode mismatch at %lld\n",
+				(long long)t1);
+			return -1;
+		}
+		if(olddecode(r1,&t2)||t2!=t1||rtc_decode(r2,&t2)||t2!=t1)
+		{
+			fprintf(stderr,"decode mismatch at %lld\n",
+				(long long)t1);
+			return -1;
+		}
+	}
+
+	if(!rtc_encode((time_t)RTC_DAY2000*86400-1,r1)||
+		!rtc_encode((time_t)(RTC_DAY2000+36525)*86400,r1))
+	{
+		fprintf(stderr,"range check failed\n");
+		return -1;
+	}
+
+	memcpy(r1,"\x00\x00\x00\x01\x30\x02\x21",7);
+	if(!rtc_decode(r1,&t2))
+	{
+		fprintf(stderr,"invalid date accepted\n");
+		return -1;
+	}
+	memcpy(r1,"\x00\x00\x00\x01\x29\x02\x21",7);
+	if(!rtc_decode(r1,&t2))
+	{
+		fprintf(stderr,"invalid leap day accepted\n");
+		return -1;
+	}
+	memcpy(r1,"\x00\x5a\x00\x01\x01\x01\x21",7);
+	if(!rtc_decode(r1,&t2))
+	{
+		fprintf(stderr,"invalid BCD accepted\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int i;
+	time_t t;
+	time_t base;
+	volatile time_t sink;
+	unsigned char r[64][7];
+	struct timespec t0;
+
+	if(verify())return 1;
+	printf("verified 2000-2099\n");
+
+	base=time(NULL);
+	for(i=0;i<64;i++)rtc_encode(base+i*86413,r[i]);
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(i=0;i<LOOPS;i++)
+	{
+		olddecode(r[i&63],&t);
+		sink=t;
+	}
+	printf("decode  struct tm/timegm  %6.1fns\n",elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(i=0;i<LOOPS;i++)
+	{
+		rtc_decode(r[i&63],&t);
+		sink=t;
+	}
+	printf("decode  rtc_decode        %6.1fns\n",elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(i=0;i<LOOPS;i++)
+	{
+		oldencode(base+i,r[i&63]);
+		sink=r[i&63][0];
+	}
+	printf("encode  gmtime_r/struct tm %5.1fns\n",elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(i=0;i<LOOPS;i++)
+	{
+		rtc_encode(base+i,r[i&63]);
+		sink=r[i&63][0];
+	}
+	printf("encode  rtc_encode        %6.1fns\n",elapsed(&t0));
+
+	(void)sink;
+	return 0;
+}
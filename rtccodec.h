@@ -0,0 +1,118 @@
+/*
+ * rtccodec.h
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#ifndef RTCCODEC_H_INCLUDED
+#define RTCCODEC_H_INCLUDED
+
+#include <time.h>
+
+/*
+ * Direct conversion between the seven DS3231 time registers and seconds
+ * since the epoch, replacing struct tm, timegm() and gmtime_r() on the
+ * time critical paths. BCD conversion is done by lookup tables built at
+ * compile time, calendar conversion by plain integer arithmetic.
+ *
+ * The DS3231 year register covers 2000 to 2099 (the century bit is not
+ * used), where every fourth year is a leap year. All register fields are
+ * validated, the hours register must be in 24 hour mode. The weekday
+ * register is 1 for Sunday like tm_wday + 1.
+ */
+
+/* 2000-01-01 in days since the epoch */
+
+#define RTC_DAY2000	10957
+
+#define RTC_B(x)	((((x)&0xf)<10&&((x)>>4)<10)?((x)>>4)*10+((x)&0xf):-1)
+#define RTC_B4(x)	RTC_B(x),RTC_B(x+1),RTC_B(x+2),RTC_B(x+3)
+#define RTC_B16(x)	RTC_B4(x),RTC_B4(x+4),RTC_B4(x+8),RTC_B4(x+12)
+#define RTC_B64(x)	RTC_B16(x),RTC_B16(x+16),RTC_B16(x+32),RTC_B16(x+48)
+
+#define RTC_D(x)	((((x)/10)<<4)|((x)%10))
+#define RTC_D10(x)	RTC_D(x),RTC_D(x+1),RTC_D(x+2),RTC_D(x+3),RTC_D(x+4),\
+			RTC_D(x+5),RTC_D(x+6),RTC_D(x+7),RTC_D(x+8),RTC_D(x+9)
+
+/* BCD to binary, -1 for invalid BCD */
+
+static const signed char rtc_bcd2bin[256]=
+{
+	RTC_B64(0),RTC_B64(64),RTC_B64(128),RTC_B64(192)
+};
+
+/* binary to BCD for 0-99 */
+
+static const unsigned char rtc_bin2bcd[100]=
+{
+	RTC_D10(0),RTC_D10(10),RTC_D10(20),RTC_D10(30),RTC_D10(40),
+	RTC_D10(50),RTC_D10(60),RTC_D10(70),RTC_D10(80),RTC_D10(90)
+};
+
+/* days before month in non leap and leap years, 13th entry is year length */
+
+static const short rtc_yday[2][13]=
+{
+	{0,31,59,90,120,151,181,212,243,273,304,334,365},
+	{0,31,60,91,121,152,182,213,244,274,305,335,366}
+};
+
+/* register bytes to epoch seconds, returns -1 for invalid contents */
+
+static inline int rtc_decode(const unsigned char *r,time_t *t)
+{
+	int sec=rtc_bcd2bin[r[0]];
+	int min=rtc_bcd2bin[r[1]];
+	int hour=rtc_bcd2bin[r[2]];
+	int mday=rtc_bcd2bin[r[4]];
+	int mon=rtc_bcd2bin[r[5]&0x7f];
+	int year=rtc_bcd2bin[r[6]];
+	int leap;
+
+	if(sec<0||sec>59||min<0||min>59||hour<0||hour>23)return -1;
+	if(r[3]<1||r[3]>7||year<0||mon<1||mon>12||mday<1)return -1;
+	leap=!(year&3);
+	if(mday>rtc_yday[leap][mon]-rtc_yday[leap][mon-1])return -1;
+	*t=(time_t)(RTC_DAY2000+year*365+((year+3)>>2)+
+		rtc_yday[leap][mon-1]+mday-1)*86400+hour*3600+min*60+sec;
+	return 0;
+}
+
+/* epoch seconds to register bytes, returns -1 if not in 2000-2099 */
+
+static inline int rtc_encode(time_t t,unsigned char *r)
+{
+	int days;
+	int secs;
+	int year;
+	int leap;
+	int mon;
+
+	if(t<(time_t)RTC_DAY2000*86400||
+		t>=(time_t)(RTC_DAY2000+36525)*86400)return -1;
+	days=t/86400;
+	secs=t%86400;
+	r[0]=rtc_bin2bcd[secs%60];
+	r[1]=rtc_bin2bcd[(secs/60)%60];
+	r[2]=rtc_bin2bcd[secs/3600];
+	r[3]=(days+4)%7+1;
+	days-=RTC_DAY2000;
+	year=(days/1461)<<2;
+	days%=1461;
+	if(days>=366)
+	{
+		days-=366;
+		year+=days/365+1;
+		days%=365;
+	}
+	leap=!(year&3);
+	for(mon=1;days>=rtc_yday[leap][mon];mon++);
+	r[4]=rtc_bin2bcd[days-rtc_yday[leap][mon-1]+1];
+	r[5]=rtc_bin2bcd[mon];
+	r[6]=rtc_bin2bcd[year];
+	return 0;
+}
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * rtcest.c
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#include <string.h>
+#include <math.h>
+#include "rtcest.h"
+
+#define ADEV_MASK	(ADEV_HIST-1)
+
+void adev_init(struct adev *a,double tau0)
+{
+	memset(a,0,sizeof(struct adev));
+	a->tau0=tau0;
+}
+
+void adev_gap(struct adev *a)
+{
+	int j;
+
+	a->n=0;
+	for(j=0;j<ADEV_LEVELS;j++)a->lvl[j].msum=0;
+}
+
+/*
+ * For the new sample i and each m=2^j the second difference
+ * x[i]-2x[i-m]+x[i-2m] is added to the Allan variance sum. For the
+ * modified Allan variance a running sum of the last m second differences
+ * is kept, the difference leaving the window is recomputed from the
+ * phase history which is why the history must hold 3m samples. All phase
+ * arithmetic is done in integer nanoseconds, so the running sums do not
+ * drift.
+ */
+
+void adev_add(struct adev *a,long long x)
+{
+	int j;
+	long long m;
+	long long d;
+	unsigned long long i=a->n++;
+
+	a->x[i&ADEV_MASK]=x;
+
+	for(j=0,m=1;j<ADEV_LEVELS&&i>=2*m;j++,m<<=1)
+	{
+		d=x-2*a->x[(i-m)&ADEV_MASK]+a->x[(i-2*m)&ADEV_MASK];
+		a->lvl[j].cnt++;
+		a->lvl[j].sum+=(double)d*(double)d;
+
+		a->lvl[j].msum+=d;
+		if(i>=3*m)a->lvl[j].msum-=a->x[(i-m)&ADEV_MASK]-
+			2*a->x[(i-2*m)&ADEV_MASK]+a->x[(i-3*m)&ADEV_MASK];
+		if(i>=3*m-1)
+		{
+			a->lvl[j].mcnt++;
+			a->lvl[j].msq+=(double)a->lvl[j].msum*
+				(double)a->lvl[j].msum;
+		}
+	}
+}
+
+int adev_get(struct adev *a,struct adevpt *pt)
+{
+	int j;
+	double m;
+
+	for(j=0,m=1;j<ADEV_LEVELS&&a->lvl[j].cnt;j++,m*=2,pt++)
+	{
+		pt->tau=m*a->tau0;
+		pt->n=a->lvl[j].cnt;
+		pt->adev=sqrt(a->lvl[j].sum/(2.0*a->lvl[j].cnt))/pt->tau*1e-9;
+		if(a->lvl[j].mcnt)pt->mdev=sqrt(a->lvl[j].msq/
+			(2.0*a->lvl[j].mcnt))/(m*pt->tau)*1e-9;
+		else pt->mdev=0;
+	}
+
+	return j;
+}
+
+void calest_init(struct calest *c)
+{
+	c->value=0;
+	c->delta=64;
+	c->total=0;
+	c->sum=0;
+}
+
+void calest_add(struct calest *c,long long period)
+{
+	c->sum+=period;
+	c->total++;
+}
+
+int calest_step(struct calest *c)
+{
+	if(!c->delta)return 1;
+	if(c->total)
+	{
+		if(c->sum/c->total>1000000000)c->value-=c->delta;
+		else c->value+=c->delta;
+	}
+	c->delta>>=1;
+	c->sum=0;
+	c->total=0;
+	return c->delta?0:1;
+}
+
+void tcxo_init(struct tcxo *t)
+{
+	memset(t,0,sizeof(struct tcxo));
+	t->temp=TCXO_NOTEMP;
+	t->phase=-1;
+	linfit_init(&t->seg);
+}
+
+static void tcxo_segment(struct tcxo *t)
+{
+	double slope;
+
+	if(!linfit_slope(&t->seg,&slope))
+	{
+		slope*=-1e-9;
+		if(t->havelast&&t->steps)t->step=slope-t->prev;
+		t->prev=slope;
+		t->havelast=1;
+		t->fsum+=slope*t->seg.n;
+		t->wsum+=t->seg.n;
+	}
+	linfit_init(&t->seg);
+}
+
+int tcxo_add(struct tcxo *t,long long sec,long long phase,int temp,int bsy)
+{
+	int flags=0;
+	int mod=((sec%TCXO_PERIOD)+TCXO_PERIOD)%TCXO_PERIOD;
+
+	if(temp!=TCXO_NOTEMP&&t->temp!=TCXO_NOTEMP&&temp!=t->temp)
+	{
+		tcxo_segment(t);
+		t->phase=mod;
+		t->steps++;
+		t->skip=1;
+		flags=TCXO_STEP|TCXO_SKIP;
+	}
+	else if(temp==TCXO_NOTEMP&&t->phase==mod)
+	{
+		tcxo_segment(t);
+		t->skip=1;
+		flags=TCXO_SKIP;
+	}
+	else if(t->skip)
+	{
+		t->skip--;
+		flags=TCXO_SKIP;
+	}
+	if(bsy)flags|=TCXO_SKIP;
+	if(temp!=TCXO_NOTEMP)t->temp=temp;
+	if(!(flags&TCXO_SKIP))linfit_add(&t->seg,sec,phase);
+	return flags;
+}
+
+void tcxo_gap(struct tcxo *t)
+{
+	tcxo_segment(t);
+}
+
+int tcxo_freq(struct tcxo *t,double *freq)
+{
+	double slope;
+	double fsum=t->fsum;
+	double wsum=t->wsum;
+
+	if(!linfit_slope(&t->seg,&slope))
+	{
+		fsum+=slope*-1e-9*t->seg.n;
+		wsum+=t->seg.n;
+	}
+	if(!wsum)return -1;
+	*freq=fsum/wsum;
+	return 0;
+}
+
+void kf_init(struct kf *k,double r,double q0,double q1,double q2)
+{
+	memset(k,0,sizeof(struct kf));
+	k->r=r;
+	k->q[0]=q0;
+	k->q[1]=q1;
+	k->q[2]=q2;
+}
+
+static void kf_advance(struct kf *k,double dt,double *x,double p[3][3])
+{
+	int i;
+	int j;
+	double f[3][3];
+	double fp[3][3];
+	double dt2=dt*dt;
+	double dt3=dt2*dt;
+
+	x[0]=k->x[0]+k->x[1]*dt+k->x[2]*dt2/2;
+	x[1]=k->x[1]+k->x[2]*dt;
+	x[2]=k->x[2];
+
+	memset(f,0,sizeof(f));
+	f[0][0]=f[1][1]=f[2][2]=1;
+	f[0][1]=f[1][2]=dt;
+	f[0][2]=dt2/2;
+
+	for(i=0;i<3;i++)for(j=0;j<3;j++)
+		fp[i][j]=f[i][0]*k->p[0][j]+f[i][1]*k->p[1][j]+
+			f[i][2]*k->p[2][j];
+	for(i=0;i<3;i++)for(j=0;j<3;j++)
+		p[i][j]=fp[i][0]*f[j][0]+fp[i][1]*f[j][1]+fp[i][2]*f[j][2];
+
+	p[0][0]+=k->q[0]*dt+k->q[1]*dt3/3+k->q[2]*dt3*dt2/20;
+	p[0][1]+=k->q[1]*dt2/2+k->q[2]*dt2*dt2/8;
+	p[0][2]+=k->q[2]*dt3/6;
+	p[1][1]+=k->q[1]*dt+k->q[2]*dt3/3;
+	p[1][2]+=k->q[2]*dt2/2;
+	p[2][2]+=k->q[2]*dt;
+	p[1][0]=p[0][1];
+	p[2][0]=p[0][2];
+	p[2][1]=p[1][2];
+}
+
+int kf_update(struct kf *k,double t,double z)
+{
+	int i;
+	int j;
+	double s;
+	double v;
+	double g[3];
+	double x[3];
+	double p[3][3];
+
+	if(!k->n)
+	{
+		memset(k->x,0,sizeof(k->x));
+		memset(k->p,0,sizeof(k->p));
+		k->x[0]=z;
+		k->p[0][0]=k->r;
+		k->p[1][1]=1e10;
+		k->p[2][2]=1e-6;
+		k->t=t;
+		k->n=1;
+		return 0;
+	}
+
+	kf_advance(k,t-k->t,x,p);
+	v=z-x[0];
+	s=p[0][0]+k->r;
+	if(k->n>1&&v*v>KF_GATE*KF_GATE*s)
+	{
+		k->outliers++;
+		if(++k->reject==KF_RESET)k->n=0;
+		return -1;
+	}
+	k->reject=0;
+
+	for(i=0;i<3;i++)g[i]=p[i][0]/s;
+	for(i=0;i<3;i++)k->x[i]=x[i]+g[i]*v;
+	for(i=0;i<3;i++)for(j=0;j<3;j++)k->p[i][j]=p[i][j]-g[i]*p[0][j];
+	k->t=t;
+	k->n++;
+	return 0;
+}
+
+void kf_step(struct kf *k,double var)
+{
+	if(k->n)k->p[1][1]+=var;
+}
+
+void kf_shift(struct kf *k,double dx)
+{
+	if(k->n)k->x[0]+=dx;
+}
+
+void kf_predict(struct kf *k,double t,double *x,double *sigma)
+{
+	double xp[3];
+	double p[3][3];
+
+	kf_advance(k,t-k->t,xp,p);
+	*x=xp[0];
+	*sigma=sqrt(p[0][0]);
+}
+
+void linfit_init(struct linfit *l)
+{
+	memset(l,0,sizeof(struct linfit));
+}
+
+void linfit_add(struct linfit *l,double x,double y)
+{
+	double dx;
+	double dy;
+
+	l->n++;
+	dx=x-l->mx;
+	l->mx+=dx/l->n;
+	dy=y-l->my;
+	l->my+=dy/l->n;
+	l->cxy+=dx*(y-l->my);
+	l->cxx+=dx*(x-l->mx);
+	l->cyy+=dy*(y-l->my);
+}
+
+int linfit_slope(struct linfit *l,double *slope)
+{
+	if(l->n<2||l->cxx<=0)return -1;
+	*slope=l->cxy/l->cxx;
+	return 0;
+}
+
+int linfit_stderr(struct linfit *l,double *err)
+{
+	double res;
+
+	if(l->n<3||l->cxx<=0)return -1;
+	res=l->cyy-l->cxy*l->cxy/l->cxx;
+	if(res<0)res=0;
+	*err=sqrt(res/(l->n-2)/l->cxx);
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * rtcest.h
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#ifndef RTCEST_H_INCLUDED
+#define RTCEST_H_INCLUDED
+
+/* number of octave spaced taus, i.e. tau0 * 1, 2, 4, ... 2048 */
+
+#define ADEV_LEVELS	12
+
+/* phase history size, must be a power of 2 and hold 3 * largest tau */
+
+#define ADEV_HIST	(1<<(ADEV_LEVELS+1))
+
+/*
+ * Streaming overlapping Allan deviation and modified Allan deviation
+ * calculator with bounded memory.
+ *
+ * Phase samples (time error in nanoseconds) are fed at the constant
+ * interval tau0. After a gap call adev_gap(), this restarts the phase
+ * history but keeps the accumulated statistics.
+ */
+
+struct adev
+{
+	double tau0;
+	unsigned long long n;
+	long long x[ADEV_HIST];
+	struct
+	{
+		unsigned long long cnt;
+		unsigned long long mcnt;
+		long long msum;
+		double sum;
+		double msq;
+	} lvl[ADEV_LEVELS];
+};
+
+struct adevpt
+{
+	double tau;
+	double adev;
+	double mdev;
+	unsigned long long n;
+};
+
+/*
+ * Ageing register estimation by binary search. The caller sets the
+ * ageing register to value, feeds the measured PPS periods of a step with
+ * calest_add() and then calls calest_step(), until calest_step() returns
+ * 1. Then value is the resulting estimate and must be set once more.
+ */
+
+struct calest
+{
+	int value;
+	int delta;
+	unsigned long total;
+	unsigned long long sum;
+};
+
+/*
+ * Incremental least squares straight line fit, numerically stable for
+ * large offsets and sample counts.
+ */
+
+struct linfit
+{
+	unsigned long long n;
+	double mx;
+	double my;
+	double cxy;
+	double cxx;
+	double cyy;
+};
+
+/*
+ * DS3231 TCXO conversion step detection. Every 64 seconds the chip
+ * measures the temperature and retrims its oscillator if the temperature
+ * changed, which shows up as a frequency step and possibly a phase glitch.
+ *
+ * Feed one sample per second: RTC second, PPS phase against the RTC second
+ * in nanoseconds, temperature register value (TCXO_NOTEMP if unknown) and
+ * the BSY status bit. A temperature change marks a step, starts a new
+ * phase fit segment and learns the conversion phase modulo 64 seconds.
+ * Without temperature segments are started at the learned conversion
+ * phase. Samples during a conversion and around a step are flagged to be
+ * skipped. The segment fits give a frequency estimate that is free of
+ * phase glitches and the frequency step of every retrim.
+ */
+
+#define TCXO_PERIOD	64
+#define TCXO_NOTEMP	(-32768)
+
+#define TCXO_STEP	0x01	/* retrim detected, new segment started */
+#define TCXO_SKIP	0x02	/* sample affected by conversion */
+
+struct tcxo
+{
+	int temp;
+	int phase;
+	int skip;
+	unsigned long steps;
+	double step;
+	double prev;
+	int havelast;
+	double fsum;
+	double wsum;
+	struct linfit seg;
+};
+
+/*
+ * Kalman filter for the clock state phase (ns), frequency (ns/s) and
+ * frequency drift (ns/s^2) of the RTC against a reference timebase, time
+ * t is in seconds of that timebase. r is the phase measurement variance
+ * (ns^2), q the noise spectral densities of white frequency, random walk
+ * frequency and random walk drift. Outliers beyond KF_GATE sigma are
+ * rejected, after KF_RESET consecutive outliers the filter restarts.
+ */
+
+#define KF_GATE		5.0
+#define KF_RESET	8
+
+struct kf
+{
+	unsigned long n;
+	unsigned long outliers;
+	int reject;
+	double t;
+	double r;
+	double q[3];
+	double x[3];
+	double p[3][3];
+};
+
+/* reset all data, tau0 is the sample interval in seconds */
+
+extern void adev_init(struct adev *a,double tau0);
+
+/* restart phase history after missing samples */
+
+extern void adev_gap(struct adev *a);
+
+/* add phase sample in nanoseconds */
+
+extern void adev_add(struct adev *a,long long x);
+
+/* get results for all taus with data, returns number of entries */
+
+extern int adev_get(struct adev *a,struct adevpt *pt);
+
+/* start ageing estimation */
+
+extern void calest_init(struct calest *c);
+
+/* add PPS period in nanoseconds */
+
+extern void calest_add(struct calest *c,long long period);
+
+/* evaluate step, returns 1 when done */
+
+extern int calest_step(struct calest *c);
+
+/* reset TCXO step detection */
+
+extern void tcxo_init(struct tcxo *t);
+
+/* add sample, returns TCXO_* flags */
+
+extern int tcxo_add(struct tcxo *t,long long sec,long long phase,int temp,
+	int bsy);
+
+/* start a new segment after a phase jump, e.g. an RTC write */
+
+extern void tcxo_gap(struct tcxo *t);
+
+/* get fractional frequency from segment fits, returns -1 if unknown */
+
+extern int tcxo_freq(struct tcxo *t,double *freq);
+
+/* reset filter */
+
+extern void kf_init(struct kf *k,double r,double q0,double q1,double q2);
+
+/* add phase measurement z at time t, returns -1 if rejected as outlier */
+
+extern int kf_update(struct kf *k,double t,double z);
+
+/* add variance to the frequency, e.g. after a TCXO retrim */
+
+extern void kf_step(struct kf *k,double var);
+
+/* shift the phase by dx, e.g. after a known RTC time change */
+
+extern void kf_shift(struct kf *k,double dx);
+
+/* predicted phase and its standard deviation at time t */
+
+extern void kf_predict(struct kf *k,double t,double *x,double *sigma);
+
+/* reset fit */
+
+extern void linfit_init(struct linfit *l);
+
+/* add data point */
+
+extern void linfit_add(struct linfit *l,double x,double y);
+
+/* get slope, returns -1 if less than two distinct x values */
+
+extern int linfit_slope(struct linfit *l,double *slope);
+
+/* get standard error of slope, returns -1 if less than three points */
+
+extern int linfit_stderr(struct linfit *l,double *err);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * rtcshm.h
+ *
+ * by Andreas Steinmetz, 2020
+ *
+ * This source is put in the public domain. Have fun!
+ */
+
+#ifndef RTCSHM_H_INCLUDED
+#define RTCSHM_H_INCLUDED
+
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdio.h>
+
+/*
+ * Time quality published by the rtctool daemon in RTCSHM_FILE, updated at
+ * every PPS edge and on PPS loss, so applications can judge the system
+ * time without asking chrony and without a system call:
+ *
+ *	struct rtcshm *s;
+ *	struct rtcshmdata d;
+ *
+ *	if((s=rtcshm_map(1,0))&&!rtcshm_read(s,&d)&&
+ *		(d.flags&RTCSHM_VALID)&&d.uncertainty<10000)...
+ *
+ * offset is system time minus RTC time at the last edge, uncertainty its
+ * standard deviation (both ns, Kalman filtered if RTCSHM_FILTER is set),
+ * freq the RTC frequency error in 1e-12 (positive if fast), temp the chip
+ * temperature in 1/100 degrees Celsius. In holdover the edge data is the
+ * last one seen and uncertainty the predicted one. The flags are cleared
+ * when the daemon fails, but not when it is killed, so readers should check
+ * the age of the last edge, too.
+ *
+ * The segment is a seqlock, the writer makes seq odd while updating. The
+ * layout is changed only together with RTCSHM_VERSION.
+ */
+
+#define RTCSHM_FILE	"/run/rtcshm.%d"
+#define RTCSHM_MAGIC	0x52544351
+#define RTCSHM_VERSION	1
+#define RTCSHM_BUSSES	256
+
+/* flags */
+
+#define RTCSHM_VALID	0x0001
+#define RTCSHM_FILTER	0x0002
+#define RTCSHM_HOLDOVER	0x0004
+#define RTCSHM_TCXO	0x0008
+
+struct rtcshmdata
+{
+	uint32_t flags;
+	int32_t temp;
+	int64_t edge_sec;
+	int64_t edge_nsec;
+	int64_t rtc_sec;
+	int64_t offset;
+	int64_t uncertainty;
+	int64_t freq;
+};
+
+struct rtcshm
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq __attribute__((aligned(64)));
+	uint32_t flags;
+	int32_t temp;
+	int32_t pad;
+	int64_t edge_sec;
+	int64_t edge_nsec;
+	int64_t rtc_sec;
+	int64_t offset;
+	int64_t uncertainty;
+	int64_t freq;
+} __attribute__((aligned(64)));
+
+#define RTCSHM_ST(s,d,f) __atomic_store_n(&(s)->f,(d)->f,__ATOMIC_RELAXED)
+#define RTCSHM_LD(s,d,f) (d)->f=__atomic_load_n(&(s)->f,__ATOMIC_RELAXED)
+
+/* map the segment of the i2c bus, returns NULL if not available */
+
+static inline struct rtcshm *rtcshm_map(int bus,int publish)
+{
+	static struct rtcshm *map[RTCSHM_BUSSES];
+	int fd;
+	struct rtcshm *s;
+	char bfr[32];
+
+	if(bus<0||bus>=RTCSHM_BUSSES)return NULL;
+	if(map[bus])return map[bus];
+	snprintf(bfr,sizeof(bfr),RTCSHM_FILE,bus);
+	if(publish)
+	{
+		if((fd=open(bfr,O_RDWR|O_CREAT|O_CLOEXEC,0644))==-1)goto err1;
+		if(ftruncate(fd,sizeof(struct rtcshm)))goto err2;
+	}
+	else if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)goto err1;
+	if((s=mmap(NULL,sizeof(struct rtcshm),
+		publish?PROT_READ|PROT_WRITE:PROT_READ,MAP_SHARED,fd,0))==
+		MAP_FAILED)goto err2;
+	close(fd);
+	if(publish)
+	{
+		__atomic_store_n(&s->version,RTCSHM_VERSION,__ATOMIC_RELAXED);
+		__atomic_store_n(&s->magic,RTCSHM_MAGIC,__ATOMIC_RELEASE);
+	}
+	else if(__atomic_load_n(&s->magic,__ATOMIC_ACQUIRE)!=RTCSHM_MAGIC||
+		__atomic_load_n(&s->version,__ATOMIC_RELAXED)!=RTCSHM_VERSION)
+	{
+		munmap(s,sizeof(struct rtcshm));
+		goto err1;
+	}
+	map[bus]=s;
+	return s;
+
+err2:	close(fd);
+err1:	return NULL;
+}
+
+/* publish new data, called by the daemon */
+
+static inline void rtcshm_publish(int bus,struct rtcshmdata *d)
+{
+	struct rtcshm *s;
+	uint32_t seq;
+
+	if(!(s=rtcshm_map(bus,1)))return;
+	seq=s->seq;
+	__atomic_store_n(&s->seq,seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	RTCSHM_ST(s,d,flags);
+	RTCSHM_ST(s,d,temp);
+	RTCSHM_ST(s,d,edge_sec);
+	RTCSHM_ST(s,d,edge_nsec);
+	RTCSHM_ST(s,d,rtc_sec);
+	RTCSHM_ST(s,d,offset);
+	RTCSHM_ST(s,d,uncertainty);
+	RTCSHM_ST(s,d,freq);
+	__atomic_store_n(&s->seq,seq+2,__ATOMIC_RELEASE);
+}
+
+/* consistent snapshot of the data, returns -1 if nothing published yet */
+
+static inline int rtcshm_read(struct rtcshm *s,struct rtcshmdata *d)
+{
+	int i;
+	uint32_t seq;
+
+	for(i=0;i<64;i++)
+	{
+		seq=__atomic_load_n(&s->seq,__ATOMIC_ACQUIRE);
+		RTCSHM_LD(s,d,flags);
+		RTCSHM_LD(s,d,temp);
+		RTCSHM_LD(s,d,edge_sec);
+		RTCSHM_LD(s,d,edge_nsec);
+		RTCSHM_LD(s,d,rtc_sec);
+		RTCSHM_LD(s,d,offset);
+		RTCSHM_LD(s,d,uncertainty);
+		RTCSHM_LD(s,d,freq);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(!(seq&1)&&seq==__atomic_load_n(&s->seq,__ATOMIC_RELAXED))
+			return seq?0:-1;
+	}
+	return -1;
+}
+
+#endif
@@ -0,0 +1,566 @@
+/*
+ * rtcsim.c
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include "rtcest.h"
+#include "rtctrace.h"
+
+#define MAXSTEP 16
+#define FL_N 16
+
+struct tstep
+{
+	unsigned long long t;
+	double temp;
+};
+
+/*
+ * Oscillator model, all frequencies are fractional, positive is fast.
+ *
+ * Flicker noise is approximated by the sum of FL_N first order
+ * autoregressive processes with octave spaced time constants of
+ * 2s to 64ks, which gives a 1/f spectrum over that range.
+ *
+ * Like the DS3231 TCXO the temperature is only converted every 64 seconds
+ * with 0.25 degree resolution, the frequency is retrimmed accordingly and
+ * every retrim may cause a phase glitch.
+ */
+
+struct sim
+{
+	double y0;
+	double drift;
+	double tempco;
+	double lsb;
+	double wpm;
+	double fpm;
+	double wfm;
+	double ffm;
+	double glitch;
+	int nstep;
+	struct tstep step[MAXSTEP];
+
+	unsigned long long n;
+	int ageing;
+	int stepidx;
+	int treg;
+	double temp;
+	double x;
+	double fla[FL_N];
+	double flpm[FL_N];
+	double flfm[FL_N];
+	uint64_t rng;
+	int spare;
+	double gspare;
+};
+
+/* trace replay source */
+
+struct replay
+{
+	struct trchdr *trc;
+	size_t len;
+	uint64_t idx;
+	uint64_t head;
+};
+
+static double urand(struct sim *s)
+{
+	s->rng^=s->rng>>12;
+	s->rng^=s->rng<<25;
+	s->rng^=s->rng>>27;
+	return ((s->rng*0x2545f4914f6cdd1dULL)>>11)*(1.0/9007199254740992.0);
+}
+
+static double grand(struct sim *s)
+{
+	double u;
+	double v;
+	double r;
+
+	if(s->spare)
+	{
+		s->spare=0;
+		return s->gspare;
+	}
+	do
+	{
+		u=2.0*urand(s)-1.0;
+		v=2.0*urand(s)-1.0;
+		r=u*u+v*v;
+	} while(r>=1.0||r==0.0);
+	r=sqrt(-2.0*log(r)/r);
+	s->gspare=v*r;
+	s->spare=1;
+	return u*r;
+}
+
+static double flicker(struct sim *s,double *state)
+{
+	int i;
+	double sum=0;
+
+	for(i=0;i<FL_N;i++)
+	{
+		state[i]=s->fla[i]*state[i]+
+			sqrt((1.0-s->fla[i]*s->fla[i])/FL_N)*grand(s);
+		sum+=state[i];
+	}
+	return sum;
+}
+
+static void siminit(struct sim *s,unsigned long long seed)
+{
+	int i;
+
+	s->n=0;
+	s->ageing=0;
+	s->stepidx=0;
+	s->temp=25.0;
+	s->treg=2500;
+	s->x=0;
+	s->rng=seed?seed:1;
+	s->spare=0;
+	for(i=0;i<FL_N;i++)
+	{
+		s->fla[i]=exp(-1.0/(2<<i));
+		s->flpm[i]=0;
+		s->flfm[i]=0;
+	}
+}
+
+/* deterministic frequency at the current time */
+
+static double simfreq(struct sim *s)
+{
+	return s->y0+s->drift*s->n-s->lsb*s->ageing+
+		s->tempco*(s->treg/100.0-25.0);
+}
+
+/* returns the system time of the next RTC second edge in nanoseconds */
+
+static long long simedge(struct sim *s)
+{
+	double y;
+
+	s->n++;
+	while(s->stepidx<s->nstep&&s->step[s->stepidx].t<=s->n)
+		s->temp=s->step[s->stepidx++].temp;
+	if(!(s->n%TCXO_PERIOD)&&lround(s->temp*4)*25!=s->treg)
+	{
+		s->treg=lround(s->temp*4)*25;
+		s->x+=s->glitch;
+	}
+	y=simfreq(s)+s->wfm*grand(s);
+	if(s->ffm)y+=s->ffm*flicker(s,s->flfm);
+	s->x+=y;
+	return s->n*1000000000LL-llround((s->x+s->wpm*grand(s)+
+		(s->fpm?s->fpm*flicker(s,s->flpm):0))*1e9);
+}
+
+static int replayopen(struct replay *r,char *fn)
+{
+	int fd;
+	struct stat stb;
+
+	if((fd=open(fn,O_RDONLY|O_CLOEXEC))==-1)goto err1;
+	if(fstat(fd,&stb)||stb.st_size<sizeof(struct trchdr))goto err2;
+	r->len=stb.st_size;
+	if((r->trc=mmap(NULL,r->len,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED)
+		goto err2;
+	close(fd);
+	if(r->trc->magic!=TRC_MAGIC||r->trc->version!=TRC_VERSION||
+		r->trc->recsize!=sizeof(struct trcrec)||!r->trc->records||
+		r->len!=sizeof(struct trchdr)+
+		(size_t)r->trc->records*sizeof(struct trcrec))goto err3;
+	r->head=__atomic_load_n(&r->trc->head,__ATOMIC_ACQUIRE);
+	r->idx=r->head>r->trc->records?r->head-r->trc->records:0;
+	return 0;
+
+err3:	munmap(r->trc,r->len);
+	return -1;
+err2:	close(fd);
+err1:	return -1;
+}
+
+/*
+ * returns the next assert edge as RTC second and phase in nanoseconds
+ * and the temperature if recorded for this edge
+ */
+
+static int replayedge(struct replay *r,long long *sec,long long *phase,
+	int *temp)
+{
+	struct trcrec rec;
+
+	while(r->idx<r->head)
+	{
+		rec=((struct trcrec *)(r->trc+1))[r->idx++%r->trc->records];
+		if((rec.flags&(TRC_CLEAR|TRC_RTC))!=TRC_RTC)continue;
+		*sec=rec.sec+rec.rtcdelta;
+		*phase=-rec.rtcdelta*1000000000LL+rec.nsec;
+		*temp=(rec.flags&TRC_TEMP)?rec.temp:TCXO_NOTEMP;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Closed loop run of the binary search ageing estimator as used by
+ * rtctool -e. Returns the resulting frequency error.
+ */
+
+static double runcal(struct sim *s,int iter,int filter,int *value,
+	int *optimal)
+{
+	int i;
+	int done=0;
+	int flags=0;
+	long long prev;
+	long long now;
+	struct calest c;
+	struct tcxo t;
+
+	calest_init(&c);
+
+	while(1)
+	{
+		s->ageing=c.value;
+		if(done)break;
+		prev=simedge(s);
+		tcxo_init(&t);
+		tcxo_add(&t,s->n,prev-s->n*1000000000LL,s->treg,0);
+		for(i=0;i<iter;i++)
+		{
+			now=simedge(s);
+			if(filter)flags=tcxo_add(&t,s->n,
+				now-s->n*1000000000LL,s->treg,0);
+			if(!(flags&TCXO_SKIP))calest_add(&c,now-prev);
+			prev=now;
+		}
+		done=calest_step(&c);
+	}
+
+	*value=c.value;
+	*optimal=lround((simfreq(s)+s->lsb*s->ageing)/s->lsb);
+	if(*optimal<-127)*optimal=-127;
+	if(*optimal>127)*optimal=127;
+	return simfreq(s);
+}
+
+/*
+ * Open loop frequency estimate by straight line fit of the phase, or with
+ * filter set by the TCXO segment fits, returns the estimate and, for
+ * simulation, the true mean frequency.
+ */
+
+static int runfreq(struct sim *s,struct replay *r,struct adev *a,
+	unsigned long long secs,int filter,double *est,double *err,
+	double *truth)
+{
+	int temp;
+	unsigned long long i;
+	long long sec;
+	long long prev=0;
+	long long phase;
+	double sum=0;
+	struct linfit l;
+	struct tcxo t;
+
+	linfit_init(&l);
+	tcxo_init(&t);
+
+	if(r)for(i=0;!replayedge(r,&sec,&phase,&temp);i++)
+	{
+		if(i&&sec!=prev+1)adev_gap(a);
+		prev=sec;
+		adev_add(a,phase);
+		linfit_add(&l,sec,phase);
+		tcxo_add(&t,sec,phase,temp,0);
+	}
+	else for(i=0;i<secs;i++)
+	{
+		phase=simedge(s)-(long long)s->n*1000000000LL;
+		sum+=simfreq(s);
+		adev_add(a,phase);
+		linfit_add(&l,s->n,phase);
+		tcxo_add(&t,s->n,phase,s->treg,0);
+	}
+
+	if(linfit_slope(&l,est))return -1;
+	*est=-*est*1e-9;
+	if(filter)if(tcxo_freq(&t,est))return -1;
+	if(linfit_stderr(&l,err))*err=0;
+	*err*=1e-9;
+	*truth=r?0:sum/secs;
+	return 0;
+}
+
+static int addstep(struct sim *s,char *str)
+{
+	char *end;
+
+	if(s->nstep==MAXSTEP)return -1;
+	s->step[s->nstep].t=strtoull(str,&end,10);
+	if(*end++!=':')return -1;
+	s->step[s->nstep].temp=strtod(end,&end);
+	if(*end)return -1;
+	if(s->nstep&&s->step[s->nstep].t<s->step[s->nstep-1].t)return -1;
+	s->nstep++;
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"Usage: rtcsim [<options>] cal|freq|adev\n"
+		"cal                    closed loop run of the rtctool -e "
+		"ageing estimator\n"
+		"freq                   frequency estimate by phase fit\n"
+		"adev                   Allan deviation of the phase\n"
+		"-r <tracefile>         replay recorded trace instead of "
+		"simulating (freq, adev)\n"
+		"-n <runs>              number of runs, default 1\n"
+		"-s <seed>              random seed, default 1\n"
+		"-T <seconds>           simulated time for freq and adev, "
+		"default 86400\n"
+		"-i <periods>           periods per estimator step for cal, "
+		"default 256\n"
+		"-y <ppm>               initial frequency offset, default 1.234\n"
+		"-Y <ppm>               randomize initial frequency offset "
+		"within +/- ppm per run\n"
+		"-d <ppm>               ageing drift per day, default 0\n"
+		"-l <ppm>               ageing register sensitivity per LSB, "
+		"default 0.1\n"
+		"-k <ppm>               temperature coefficient per degree, "
+		"default 0\n"
+		"-t <second>:<degrees>  temperature step (repeatable, start "
+		"is 25)\n"
+		"-p <ns>                white phase noise, default 1000\n"
+		"-P <ns>                flicker phase noise, default 0\n"
+		"-f <ppb>               white frequency noise, default 1\n"
+		"-F <ppb>               flicker frequency noise, default 0\n"
+		"-g <ns>                phase glitch at every TCXO retrim, "
+		"default 0\n"
+		"-x                     no TCXO conversion filtering for cal "
+		"and freq\n");
+	exit(1);
+}
+
+int main(int argc,char *argv[])
+{
+	int c;
+	int i;
+	int mode;
+	int runs=1;
+	int iter=256;
+	int value;
+	int optimal;
+	int exact=0;
+	int filter=1;
+	int n;
+	unsigned long long seed=1;
+	unsigned long long secs=86400;
+	double yrand=0;
+	double res;
+	double est;
+	double err;
+	double truth;
+	double sum=0;
+	double sq=0;
+	double clk;
+	char *trace=NULL;
+	struct sim s;
+	struct replay r;
+	struct adev *a;
+	struct adevpt pt[ADEV_LEVELS];
+	struct timespec t0;
+	struct timespec t1;
+
+	memset(&s,0,sizeof(s));
+	s.y0=1.234e-6;
+	s.lsb=1e-7;
+	s.wpm=1e-6;
+	s.wfm=1e-9;
+
+	while((c=getopt(argc,argv,"r:n:s:T:i:y:Y:d:l:k:t:p:P:f:F:g:x"))!=-1)
+		switch(c)
+	{
+	case 'r':
+		trace=optarg;
+		break;
+
+	case 'n':
+		if((runs=atoi(optarg))<1)usage();
+		break;
+
+	case 's':
+		seed=strtoull(optarg,NULL,10);
+		break;
+
+	case 'T':
+		if(!(secs=strtoull(optarg,NULL,10)))usage();
+		break;
+
+	case 'i':
+		if((iter=atoi(optarg))<1)usage();
+		break;
+
+	case 'y':
+		s.y0=atof(optarg)*1e-6;
+		break;
+
+	case 'Y':
+		if((yrand=atof(optarg)*1e-6)<=0)usage();
+		break;
+
+	case 'd':
+		s.drift=atof(optarg)*1e-6/86400.0;
+		break;
+
+	case 'l':
+		if((s.lsb=atof(optarg)*1e-6)<=0)usage();
+		break;
+
+	case 'k':
+		s.tempco=atof(optarg)*1e-6;
+		break;
+
+	case 't':
+		if(addstep(&s,optarg))usage();
+		break;
+
+	case 'p':
+		if((s.wpm=atof(optarg)*1e-9)<0)usage();
+		break;
+
+	case 'P':
+		if((s.fpm=atof(optarg)*1e-9)<0)usage();
+		break;
+
+	case 'f':
+		if((s.wfm=atof(optarg)*1e-9)<0)usage();
+		break;
+
+	case 'F':
+		if((s.ffm=atof(optarg)*1e-9)<0)usage();
+		break;
+
+	case 'g':
+		s.glitch=atof(optarg)*1e-9;
+		break;
+
+	case 'x':
+		filter=0;
+		break;
+
+	default:usage();
+		break;
+	}
+
+	if(optind!=argc-1)usage();
+	if(!strcmp(argv[optind],"cal"))mode=0;
+	else if(!strcmp(argv[optind],"freq"))mode=1;
+	else if(!strcmp(argv[optind],"adev"))mode=2;
+	else usage();
+	if(trace&&!mode)usage();
+	if(trace)runs=1;
+
+	if(!(a=malloc(sizeof(struct adev))))
+	{
+		perror("malloc");
+		return 1;
+	}
+	adev_init(a,1.0);
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+
+	for(i=0;i<runs;i++)
+	{
+		siminit(&s,seed+i);
+		if(yrand)s.y0=(2.0*urand(&s)-1.0)*yrand;
+		adev_gap(a);
+
+		if(!mode)
+		{
+			res=runcal(&s,iter,filter,&value,&optimal);
+			if(value==optimal)exact++;
+			printf("run %d: offset %+.3fppm ageing %d optimal %d "
+				"residual %+.4fppm\n",i+1,s.y0*1e6,value,
+				optimal,res*1e6);
+			sum+=fabs(res);
+			sq+=res*res;
+			continue;
+		}
+
+		if(trace)
+		{
+			if(replayopen(&r,trace))
+			{
+				fprintf(stderr,"%s: not a trace file\n",trace);
+				free(a);
+				return 1;
+			}
+		}
+		if(runfreq(&s,trace?&r:NULL,a,secs,filter,&est,&err,&truth))
+		{
+			fprintf(stderr,"Not enough data.\n");
+			if(trace)munmap(r.trc,r.len);
+			free(a);
+			return 1;
+		}
+		if(trace)munmap(r.trc,r.len);
+		if(mode==1)
+		{
+			if(trace)printf("frequency %+.5fppm +/- %.5fppm\n",
+				est*1e6,err*1e6);
+			else printf("run %d: frequency %+.5fppm +/- %.5fppm "
+				"true %+.5fppm error %+.5fppm\n",i+1,est*1e6,
+				err*1e6,truth*1e6,(est-truth)*1e6);
+			sum+=fabs(est-truth);
+			sq+=(est-truth)*(est-truth);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	clk=t1.tv_sec-t0.tv_sec+(t1.tv_nsec-t0.tv_nsec)*1e-9;
+
+	switch(mode)
+	{
+	case 0:	printf("%d runs: mean |residual| %.4fppm rms %.4fppm, "
+			"%d optimal\n",runs,sum/runs*1e6,sqrt(sq/runs)*1e6,
+			exact);
+		printf("simulated %llus in %.3fs\n",
+			(unsigned long long)(iter+1)*7*runs,clk);
+		break;
+
+	case 1:	if(trace)break;
+		printf("%d runs: mean |error| %.5fppm rms %.5fppm\n",runs,
+			sum/runs*1e6,sqrt(sq/runs)*1e6);
+		printf("simulated %llus in %.3fs\n",secs*runs,clk);
+		break;
+
+	case 2:	n=adev_get(a,pt);
+		printf("     tau        adev        mdev   samples\n");
+		for(i=0;i<n;i++)printf("%8.0f %11.3e %11.3e %9llu\n",
+			pt[i].tau,pt[i].adev,pt[i].mdev,pt[i].n);
+		break;
+	}
+
+	free(a);
+	return 0;
+}
@@ -6,19 +6,97 @@
  * License: GPLv2 (no later version)
  */
 
+#define _GNU_SOURCE
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <linux/pps.h>
+#include <linux/gpio.h>
+#include <linux/rtc.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/timex.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include <sched.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <time.h>
 #include <string.h>
 #include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include "rtcest.h"
+#include "rtctrace.h"
+#include "i2carb.h"
+#include "rtcshm.h"
+#include "rtccodec.h"
+
+#define CTLSOCK "/run/rtctool.%d.sock"
+#define CTL_MAGIC 0x52544331
+#define CTL_WINDOW 800000000
+#define CTL_DUALWINDOW 300000000
+#define CTL_STATE 1
+#define CTL_ADEV 2
+#define CTL_SETRTC 3
+#define RT_STACK (256*1024)
+#define LAT_MAX 86400
+#define GPIO_EVBUF 1024
+#define SQW_MAXTIME 3600
+#define NTP_EPOCH 2208988800LL
+#define NTP_STRATUM 12
+#define NTP_PKTLEN 48
+#define DRIFTDIR "/var/lib/rtctool"
+#define DRIFTFILE DRIFTDIR "/drift.%s%d"
+#define AGEFILE DRIFTDIR "/ageing.%d"
+#define AGE_SWEEP 128
+#define CONFFILE DRIFTDIR "/config"
+#define SENSFILE DRIFTDIR "/sens.%d"
+#define OFFFILE DRIFTDIR "/offdrift.%s%d"
+#define RTCKEY 256
+#define OFF_MINHOURS 1.0
+#define OFF_MAXRATE 1e7
+#define OFF_MAXCORR 10000000000LL
+#define OFF_AVG 8
+#define SENS_NOMINAL -0.1
+#define SENS_POINTS 5
+#define SENS_SECS 256
+#define SENS_MAX 64
+#define SENS_LIMIT 0.5
+#define SENSKEY(t) (((t)+((t)<0?-50:50))/100)
+#define DISC_MAX 32
+#define GATE_CHECK 3600
+#define RTCDEV_TIMEOUT 1500
+#define RTCDEV_POLL 1000000
+#define KF_RSIGMA 2000
+#define KF_R ((double)KF_RSIGMA*KF_RSIGMA)
+#define KF_Q0 1.0
+#define KF_Q1 1e-3
+#define KF_Q2 1e-12
+#define KF_TSTEP 2500.0
+#define KF_WARMUP 16
+#define KF_MAXSIGMA 1e7
+#define HOST_AVG 64
+#define HOST_MAXPPM 1000.0
+#define PPS_RING 16
+#define HIST_BUCKETS 10
+#define METRICS_INTERVAL 15
+#define RECONNECT_MAX 64
+#define PPSEV_EDGE 0
+#define PPSEV_TIMEOUT 1
+#define PPSEV_ERROR 2
+#define PPSEV_REOPEN 3
+#define PPSEV_NODEV 4
 
 struct shmtm
 {
@@ -37,6 +115,168 @@ struct shmtm
 	int dummy[8];
 };
 
+struct ppsedge
+{
+	int valid;
+	int edge;
+	unsigned long count;
+	unsigned long seq[2];
+	struct timespec stamp;
+};
+
+struct offrec
+{
+	time_t when;
+	long long off;
+	int pending;
+	int n;
+	double rate;
+};
+
+struct sensent
+{
+	int temp;
+	double sens;
+};
+
+struct busprobe
+{
+	int bus;
+	int rtc;
+	int eeprom;
+	int pps;
+};
+
+struct hist
+{
+	unsigned long n[HIST_BUCKETS+1];
+	double sum;
+};
+
+struct ppsevt
+{
+	int type;
+	struct ppsedge e;
+};
+
+struct ppsring
+{
+	unsigned int head;
+	unsigned long overrun;
+	int efd;
+	int pps;
+	int ppsid;
+	int dual;
+	int lock;
+	int gap;
+	struct ppsedge e;
+	unsigned int tail __attribute__((aligned(64)));
+	struct ppsevt ev[PPS_RING] __attribute__((aligned(64)));
+};
+
+struct shmcfg
+{
+	int i2cid;
+	int ppsid;
+	int ntpid;
+	int bg;
+	int lock;
+	int dual;
+	int jump;
+	int ntpport;
+	int stratum;
+	int hold;
+	char *trace;
+	char *metrics;
+};
+
+struct ctlreq
+{
+	unsigned int magic;
+	unsigned int cmd;
+	int arg;
+};
+
+struct ctlpend
+{
+	unsigned int cmd;
+	int arg;
+	socklen_t alen;
+	struct sockaddr_un a;
+};
+
+struct ctlstate
+{
+	time_t rtcsec;
+	struct timespec edge;
+	int pps;
+	int ageing;
+	int temp;
+	unsigned long tcxosteps;
+	double tcxostep;
+	unsigned long missed;
+	unsigned long timeouts;
+	unsigned long ppserr;
+	unsigned long i2cerr;
+	unsigned long reopen;
+	unsigned long rtcsets;
+	unsigned long overruns;
+	unsigned long outliers;
+	unsigned long holdover;
+	int health;
+	int freqok;
+	double kffreq;
+	double kfsigma;
+	long long offset;
+	struct hist jitter;
+	struct hist i2clat;
+};
+
+struct ctladev
+{
+	int n;
+	struct adevpt pt[ADEV_LEVELS];
+};
+
+struct ntpsrv
+{
+	int s;
+	int valid;
+	time_t rtcsec;
+	struct timespec edge;
+	double freq;
+	unsigned char tpl[NTP_PKTLEN];
+};
+
+struct ctlrpy
+{
+	unsigned int magic;
+	unsigned int cmd;
+	int status;
+	union
+	{
+		struct ctlstate state;
+		struct ctladev adev;
+	} u;
+};
+
+/* histogram bucket limits in ns, the last bucket is +Inf */
+
+static const long long jitterle[HIST_BUCKETS]=
+{
+	1000,2000,5000,10000,20000,50000,100000,200000,500000,1000000
+};
+
+static const long long i2clatle[HIST_BUCKETS]=
+{
+	100000,200000,300000,500000,1000000,2000000,5000000,10000000,
+	20000000,50000000
+};
+
+/* bus arbitration priority of this process, see i2carb.h */
+
+static int i2cprio=I2CARB_BULK;
+
 static int openi2cdev(int bus,int device)
 {
 	int fd;
@@ -72,7 +312,13 @@ static int readi2cbytes(int fd,int reg,int n,unsigned char *dest)
 	ctl.command=reg;
 	ctl.size=I2C_SMBUS_I2C_BLOCK_DATA;
 	ctl.data=&data;
-	if(ioctl(fd,I2C_SMBUS,&ctl)==-1)return -1;
+	i2carb_lock(fd,i2cprio);
+	if(ioctl(fd,I2C_SMBUS,&ctl)==-1)
+	{
+		i2carb_unlock(fd);
+		return -1;
+	}
+	i2carb_unlock(fd);
 	memcpy(dest,data.block+1,n);
 	return 0;
 }
@@ -88,11 +334,17 @@ static int writei2cbytes(int fd,int reg,int n,unsigned char *src)
 	ctl.command=reg;
 	ctl.size=I2C_SMBUS_I2C_BLOCK_DATA;
 	ctl.data=&data;
-	if(ioctl(fd,I2C_SMBUS,&ctl)==-1)return -1;
+	i2carb_lock(fd,i2cprio);
+	if(ioctl(fd,I2C_SMBUS,&ctl)==-1)
+	{
+		i2carb_unlock(fd);
+		return -1;
+	}
+	i2carb_unlock(fd);
 	return 0;
 }
 
-static int ppsopen(int id)
+static int ppsopen(int id,int dual)
 {
 	int fd;
 	int caps;
@@ -105,6 +357,7 @@ static int ppsopen(int id)
 	if(ioctl(fd,PPS_GETCAP,&caps))goto err2;
 	if(!(caps&PPS_CAPTUREASSERT))goto err2;
 	if(!(caps&PPS_CANWAIT))goto err2;
+	if(dual&&!(caps&PPS_CAPTURECLEAR))goto err2;
 	if(ioctl(fd,PPS_GETPARAMS,&parm))goto err2;
 	parm.mode|=PPS_CAPTUREASSERT;
 	if(caps&PPS_OFFSETASSERT)
@@ -112,6 +365,15 @@ static int ppsopen(int id)
 		parm.mode|=PPS_OFFSETASSERT;
 		memset(&parm.assert_off_tu,0,sizeof(parm.assert_off_tu));
 	}
+	if(dual)
+	{
+		parm.mode|=PPS_CAPTURECLEAR;
+		if(caps&PPS_OFFSETCLEAR)
+		{
+			parm.mode|=PPS_OFFSETCLEAR;
+			memset(&parm.clear_off_tu,0,sizeof(parm.clear_off_tu));
+		}
+	}
 	if(ioctl(fd,PPS_SETPARAMS,&parm))goto err2;
 	return fd;
 
@@ -133,46 +395,96 @@ static int ppswait(int fd,unsigned long *seq,struct timespec *stamp)
 	return 0;
 }
 
+/*
+ * Waits for the next assert or clear edge, edge is 0 for assert and 1
+ * for clear. If both sequence numbers changed an edge was missed and the
+ * more recent edge is returned. count is the total number of edges seen
+ * by the kernel and thus increments by exactly one if no edge was missed.
+ */
+
+static int ppswaitedge(int fd,struct ppsedge *e)
+{
+	int a;
+	int c;
+	struct pps_fdata data;
+
+	data.timeout.sec=1;
+	data.timeout.nsec=500000000;
+	data.timeout.flags=~PPS_TIME_INVALID;
+	if(ioctl(fd,PPS_FETCH,&data))return -1;
+	a=(!e->valid||data.info.assert_sequence!=e->seq[0]);
+	c=(!e->valid||data.info.clear_sequence!=e->seq[1]);
+	if(a&&c)
+	{
+		if(data.info.clear_tu.sec>data.info.assert_tu.sec||
+			(data.info.clear_tu.sec==data.info.assert_tu.sec&&
+			data.info.clear_tu.nsec>data.info.assert_tu.nsec))a=0;
+		else c=0;
+	}
+	if(a)
+	{
+		e->edge=0;
+		e->stamp.tv_sec=data.info.assert_tu.sec;
+		e->stamp.tv_nsec=data.info.assert_tu.nsec;
+	}
+	else if(c)
+	{
+		e->edge=1;
+		e->stamp.tv_sec=data.info.clear_tu.sec;
+		e->stamp.tv_nsec=data.info.clear_tu.nsec;
+	}
+	else
+	{
+		errno=ETIMEDOUT;
+		return -1;
+	}
+	e->valid=1;
+	e->seq[0]=data.info.assert_sequence;
+	e->seq[1]=data.info.clear_sequence;
+	e->count=e->seq[0]+e->seq[1];
+	return 0;
+}
+
+static long long tsdiff(struct timespec *now,struct timespec *prev)
+{
+	return (now->tv_sec-prev->tv_sec)*1000000000LL+
+		now->tv_nsec-prev->tv_nsec;
+}
+
+static void tsadd(struct timespec *ts,long long ns)
+{
+	ts->tv_sec+=ns/1000000000;
+	ts->tv_nsec+=ns%1000000000;
+	if(ts->tv_nsec<0)
+	{
+		ts->tv_nsec+=1000000000;
+		ts->tv_sec--;
+	}
+	else if(ts->tv_nsec>=1000000000)
+	{
+		ts->tv_nsec-=1000000000;
+		ts->tv_sec++;
+	}
+}
+
 static int ds3231_open(int bus)
 {
 	return openi2cdev(bus,0x68);
 }
 
-static int ds3231_read_time(int fd,struct tm *datim)
+static int ds3231_read_time(int fd,time_t *t)
 {
 	unsigned char i2cdatim[7];
 
 	if(readi2cbytes(fd,0x00,7,i2cdatim))return -1;
-	if(i2cdatim[2]&0x40)return -1;
-
-	datim->tm_sec=(i2cdatim[0]&0xf)+10*(i2cdatim[0]>>4);
-	datim->tm_min=(i2cdatim[1]&0xf)+10*(i2cdatim[1]>>4);
-	datim->tm_hour=(i2cdatim[2]&0xf)+10*(i2cdatim[2]>>4);
-	datim->tm_wday=i2cdatim[3]-1;
-	datim->tm_mday=(i2cdatim[4]&0xf)+10*(i2cdatim[4]>>4);
-	datim->tm_mon=(i2cdatim[5]&0xf)+10*((i2cdatim[5]&0x7f)>>4)-1;
-	datim->tm_year=(i2cdatim[6]&0xf)+10*(i2cdatim[6]>>4)+100;
-	datim->tm_yday=0;
-	datim->tm_isdst=0;
-	return 0;
+	return rtc_decode(i2cdatim,t);
 }
 
-static int ds3231_write_time(int fd, struct tm *datim)
+static int ds3231_write_time(int fd,time_t t)
 {
-	int val;
 	unsigned char i2cdatim[7];
 
-	if(datim->tm_min>59||datim->tm_year<100||datim->tm_year>199)return -1;
-
-	i2cdatim[0]=(datim->tm_sec%10)+((datim->tm_sec/10)<<4);
-	i2cdatim[1]=(datim->tm_min%10)+((datim->tm_min/10)<<4);
-	i2cdatim[2]=(datim->tm_hour%10)+((datim->tm_hour/10)<<4);
-	i2cdatim[3]=datim->tm_wday+1;
-	i2cdatim[4]=(datim->tm_mday%10)+((datim->tm_mday/10)<<4);
-	val=datim->tm_mon+1;
-	i2cdatim[5]=(val%10)+((val/10)<<4);
-	val=datim->tm_year-100;
-	i2cdatim[6]=(val%10)+((val/10)<<4);
+	if(rtc_encode(t,i2cdatim))return -1;
 	return writei2cbytes(fd,0x00,7,i2cdatim);
 }
 
@@ -200,19 +512,36 @@ static int ds3231_pps(int fd,int mode)
 	}
 }
 
-static int ds3231_systohc(int fd,int relaxed)
+/* rs: 0=1Hz, 1=1.024kHz, 2=4.096kHz, 3=8.192kHz */
+
+static int ds3231_sqw(int fd,int rs)
 {
-	int m;
+	unsigned char data;
+
+	if(rs<0||rs>3)return -1;
+	data=rs<<3;
+	if(writei2cbytes(fd,0x0e,1,&data))return -1;
+	return 0;
+}
+
+/*
+ * Writes the time at the next system second boundary, with nopps set the
+ * PPS output is left running, which glitches the PPS edges, so only the
+ * daemon that handles this itself may do so.
+ */
+
+static int ds3231_systohc(int fd,int relaxed,int nopps)
+{
+	int m=0;
+	time_t t;
 	struct timespec now;
 	struct timespec next;
-	struct tm datim;
 
-	if((m=ds3231_pps(fd,-1))==-1)goto err1;
+	if(!nopps)if((m=ds3231_pps(fd,-1))==-1)goto err1;
 	if(clock_gettime(CLOCK_REALTIME,&now))goto err1;
 	next.tv_sec=now.tv_sec+(now.tv_nsec>=900000000?1:0);
 	next.tv_nsec=999500000;
-	now.tv_sec=next.tv_sec+1;
-	gmtime_r(&now.tv_sec,&datim);
+	t=next.tv_sec+1;
 	if(clock_nanosleep(CLOCK_REALTIME,TIMER_ABSTIME,&next,NULL))goto err1;
 	if(m)if(ds3231_pps(fd,0))goto err1;
 	if(!relaxed)
@@ -228,7 +557,7 @@ static int ds3231_systohc(int fd,int relaxed)
 		}
 		else goto err2;
 	}
-	if(ds3231_write_time(fd,&datim))goto err2;
+	if(ds3231_write_time(fd,t))goto err2;
 	if(m)if(ds3231_pps(fd,1))goto err1;
 	return 0;
 
@@ -236,19 +565,23 @@ err2:	if(m)ds3231_pps(fd,1);
 err1:	return -1;
 }
 
-static int ds3231_hctosys_pps(int i2c,int pps)
+/*
+ * The hctosys variants add corr nanoseconds to the RTC time, the offset
+ * predicted by offpredict().
+ */
+
+static int ds3231_hctosys_pps(int i2c,int pps,long long corr)
 {
 	unsigned long seq;
 	struct timespec now;
 	struct timespec next;
-	struct tm datim;
 	time_t t;
 
 	if(ppswait(pps,&seq,&now))return -1;
-	if(ds3231_read_time(i2c,&datim))return -1;
-	t=timegm(&datim);
+	if(ds3231_read_time(i2c,&t))return -1;
 	next.tv_sec=t+1;
 	next.tv_nsec=0;
+	tsadd(&next,corr);
 	now.tv_nsec+=999500000;
 	if(now.tv_nsec>=1000000000)
 	{
@@ -260,10 +593,45 @@ static int ds3231_hctosys_pps(int i2c,int pps)
 	return 0;
 }
 
-static int ds3231_hctosys_guessed(int fd)
+/*
+ * Boot time quick mode, a single read gives the RTC second, which is set
+ * as its middle so the system time is at most half a second off until the
+ * daemon started with -j corrects it at the first clean PPS edge.
+ */
+
+static int ds3231_hctosys_coarse(int fd,long long corr)
+{
+	struct timespec tv;
+
+	if(ds3231_read_time(fd,&tv.tv_sec))return -1;
+	tv.tv_nsec=500000000;
+	tsadd(&tv,corr);
+	if(clock_settime(CLOCK_REALTIME,&tv))return -1;
+	return 0;
+}
+
+/* step the system clock by the given amount of nanoseconds */
+
+static int clkstep(long long ns)
+{
+	struct timex tx;
+
+	memset(&tx,0,sizeof(tx));
+	tx.modes=ADJ_SETOFFSET|ADJ_NANO;
+	tx.time.tv_sec=ns/1000000000;
+	tx.time.tv_usec=ns%1000000000;
+	if(tx.time.tv_usec<0)
+	{
+		tx.time.tv_usec+=1000000000;
+		tx.time.tv_sec--;
+	}
+	if(clock_adjtime(CLOCK_REALTIME,&tx)==-1)return -1;
+	return 0;
+}
+
+static int ds3231_hctosys_guessed(int fd,long long corr)
 {
 	struct timespec tv;
-	struct tm datim;
 	time_t t;
 	time_t cmp=-1;
 
@@ -272,216 +640,2213 @@ static int ds3231_hctosys_guessed(int fd)
 
 	while(1)
 	{
-		if(ds3231_read_time(fd,&datim))return -1;
-		t=timegm(&datim);
+		if(ds3231_read_time(fd,&t))return -1;
 		if(cmp==-1)cmp=t;
 		else if(cmp!=t)break;
 		if(clock_nanosleep(CLOCK_REALTIME,0,&tv,NULL))return -1;
 	}
 	tv.tv_sec=t;
 	tv.tv_nsec=0;
+	tsadd(&tv,corr);
 	if(clock_settime(CLOCK_REALTIME,&tv))return -1;
 	return 0;
 }
 
-static int ds3231_get_ageing(int fd,int *value)
+/*
+ * Backend for an RTC bound by a kernel driver (e.g. rtc-ds1307), using
+ * /dev/rtcN instead of raw i2c access. The second rollover is detected by
+ * the update interrupt of the driver or, if not supported, by polling the
+ * time every RTCDEV_POLL nanoseconds.
+ */
+
+static int rtcdev_open(int id)
 {
-	signed char data;
+	char bfr[32];
 
-	if(readi2cbytes(fd,0x10,1,(unsigned char *)&data))return -1;
-	*value=data;
-	return 0;
+	if(id<0||id>255)return -1;
+	snprintf(bfr,sizeof(bfr),"/dev/rtc%d",id);
+	return open(bfr,O_RDONLY|O_CLOEXEC);
 }
 
-static int ds3231_set_ageing(int fd,int value)
+static int rtcdev_read_time(int fd,time_t *t)
 {
-	unsigned char ctrl;
-	unsigned char data;
+	struct rtc_time tm;
+	struct tm datim;
 
-	if(value<-127||value>127)return -1;
+	if(ioctl(fd,RTC_RD_TIME,&tm))return -1;
+	memset(&datim,0,sizeof(datim));
+	datim.tm_sec=tm.tm_sec;
+	datim.tm_min=tm.tm_min;
+	datim.tm_hour=tm.tm_hour;
+	datim.tm_mday=tm.tm_mday;
+	datim.tm_mon=tm.tm_mon;
+	datim.tm_year=tm.tm_year;
+	if((*t=timegm(&datim))==(time_t)(-1))return -1;
+	return 0;
+}
 
-	while(1)
-	{
-		while(1)
-		{
-			if(readi2cbytes(fd,0x0e,1,&ctrl))return -1;
-			if(!(ctrl&0x20))break;
-			usleep(1000);
-		}
+static int rtcdev_write_time(int fd,time_t t)
+{
+	struct rtc_time tm;
+	struct tm datim;
 
-		while(1)
-		{
-			if(readi2cbytes(fd,0x0f,1,&data))return -1;
-			if(!(data&0x04))break;
-			usleep(1000);
-		}
+	gmtime_r(&t,&datim);
+	memset(&tm,0,sizeof(tm));
+	tm.tm_sec=datim.tm_sec;
+	tm.tm_min=datim.tm_min;
+	tm.tm_hour=datim.tm_hour;
+	tm.tm_mday=datim.tm_mday;
+	tm.tm_mon=datim.tm_mon;
+	tm.tm_year=datim.tm_year;
+	tm.tm_wday=datim.tm_wday;
+	tm.tm_yday=datim.tm_yday;
+	if(ioctl(fd,RTC_SET_TIME,&tm))return -1;
+	return 0;
+}
 
-		data=(unsigned char)value;
-		if(writei2cbytes(fd,0x10,1,&data))return -1;
+/*
+ * Wait for the next RTC second, returns it and the system time it began.
+ * Drivers without update interrupt support fail RTC_UIE_ON or (without
+ * alarm, as emulated by the RTC core) never deliver one, both fall back
+ * to polling for the rest of the run.
+ */
 
-		ctrl|=0x20;
-		if(writei2cbytes(fd,0x0e,1,&ctrl))return -1;
+static int rtcdev_edge(int fd,time_t *t,struct timespec *stamp)
+{
+	static int nouie;
+	int i;
+	unsigned long data;
+	time_t cmp;
+	struct pollfd p;
+	struct timespec tv;
 
-		if(readi2cbytes(fd,0x0f,1,&data))return -1;
-		if(!(data&0x04))break;
-		usleep(1000);
+	if(!nouie&&!ioctl(fd,RTC_UIE_ON,0))
+	{
+		p.fd=fd;
+		p.events=POLLIN;
+		if(poll(&p,1,RTCDEV_TIMEOUT)==1&&
+			read(fd,&data,sizeof(data))==sizeof(data))
+		{
+			clock_gettime(CLOCK_REALTIME,stamp);
+			ioctl(fd,RTC_UIE_OFF,0);
+			return rtcdev_read_time(fd,t);
+		}
+		ioctl(fd,RTC_UIE_OFF,0);
+		nouie=1;
 	}
 
-	while(1)
+	tv.tv_sec=0;
+	tv.tv_nsec=RTCDEV_POLL;
+	if(rtcdev_read_time(fd,&cmp))return -1;
+	for(i=0;i<RTCDEV_TIMEOUT*1000000LL/RTCDEV_POLL;i++)
 	{
-		if(readi2cbytes(fd,0x0e,1,&ctrl))return -1;
-		if(!(ctrl&0x20))break;
-		usleep(1000);
+		if(clock_nanosleep(CLOCK_REALTIME,0,&tv,NULL))return -1;
+		clock_gettime(CLOCK_REALTIME,stamp);
+		if(rtcdev_read_time(fd,t))return -1;
+		if(*t!=cmp)return 0;
 	}
-
-	return 0;
+	return -1;
 }
 
-static int ds3231_get_temp(int fd,int *value)
+static int rtcdev_systohc(int fd,int relaxed)
 {
-	unsigned char data[2];
+	time_t t;
+	struct timespec now;
+	struct timespec next;
 
-	if(readi2cbytes(fd,0x11,2,data))return -1;
-	*value=((signed char)data[0])*100;
-	switch(data[1]&0xc0)
+	if(clock_gettime(CLOCK_REALTIME,&now))return -1;
+	next.tv_sec=now.tv_sec+(now.tv_nsec>=900000000?1:0);
+	next.tv_nsec=999500000;
+	t=next.tv_sec+1;
+	if(clock_nanosleep(CLOCK_REALTIME,TIMER_ABSTIME,&next,NULL))return -1;
+	if(!relaxed)
 	{
-	case 0x40:
-		if(*value<0)*value-=25;
-		else *value+=25;
-		break;
-	case 0x80:
-		if(*value<0)*value-=50;
-		else *value+=50;
-		break;
-	case 0xc0:
-		if(*value<0)*value-=75;
-		else *value+=75;
-		break;
+		if(clock_gettime(CLOCK_REALTIME,&now))return -1;
+		if(now.tv_sec==next.tv_sec)
+		{
+			if(now.tv_nsec<999000000)return -1;
+		}
+		else if(now.tv_sec==next.tv_sec+1)
+		{
+			if(now.tv_nsec>1000000)return -1;
+		}
+		else return -1;
 	}
-	return 0;
+	return rtcdev_write_time(fd,t);
 }
 
-static int ds3231_estimate_calibration(int i2c,int pps,int iter,int *result,
-	int (*callback)(int current,int total,void *param),void *param)
+static int rtcdev_hctosys(int fd,int quick,long long corr)
 {
-	int total;
-	int value=0;
-	int delta=64;
-	int rqdsec;
-	int currsec=0;
-	unsigned long seq;
-	unsigned long lcl;
-	unsigned long long sum;
+	time_t t;
 	struct timespec now;
-	struct timespec prev;
-	struct timespec data;
+	struct timespec stamp;
 
-	rqdsec=(iter+1)*7;
-
-	while(1)
+	if(quick)
 	{
-		if(ds3231_set_ageing(i2c,value))return -1;
+		if(rtcdev_read_time(fd,&now.tv_sec))return -1;
+		now.tv_nsec=500000000;
+		tsadd(&now,corr);
+		if(clock_settime(CLOCK_REALTIME,&now))return -1;
+		return 0;
+	}
+	if(rtcdev_edge(fd,&t,&stamp))return -1;
+	if(clock_gettime(CLOCK_REALTIME,&now))return -1;
+	now.tv_sec+=t-stamp.tv_sec;
+	tsadd(&now,corr-stamp.tv_nsec);
+	if(clock_settime(CLOCK_REALTIME,&now))return -1;
+	return 0;
+}
 
-		if(!delta)break;
+/* like ds3231_offset() from the next second rollover */
 
-		if(ppswait(pps,&lcl,&prev))return -1;
-		if(callback)if(callback(++currsec,rqdsec,param))return -1;
+static int rtcdev_offset(int fd,long long *off)
+{
+	time_t t;
+	struct timespec stamp;
 
-		for(sum=0,total=0;total<iter;total++)
-		{
-			if(ppswait(pps,&seq,&now))return -1;
-			if(callback)if(callback(++currsec,rqdsec,param))
-				return -1;
-			if(++lcl!=seq)return -1;
-			if(now.tv_sec<prev.tv_sec)return -1;
-			data.tv_sec=now.tv_sec-prev.tv_sec;
-			if(data.tv_sec>1)return -1;
-			if(now.tv_nsec<prev.tv_nsec)
-			{
-				if(!data.tv_sec)return -1;
-				data.tv_sec--;
-				data.tv_nsec=now.tv_nsec+1000000000-
-					prev.tv_nsec;
-			}
-			else data.tv_nsec=now.tv_nsec-prev.tv_nsec;
-			prev=now;
-			if(data.tv_sec)
-			{
-				if(data.tv_nsec>100000000)return -1;
-			}
-			else if(data.tv_nsec<900000000)return -1;
-			sum+=data.tv_sec?1000000000:0;
-			sum+=data.tv_nsec;
-		}
+	if(rtcdev_edge(fd,&t,&stamp))return -1;
+	*off=(stamp.tv_sec-t)*1000000000LL+stamp.tv_nsec;
+	return 0;
+}
+
+/*
+ * Offset of the RTC against the system clock in nanoseconds from the next
+ * PPS edge, positive if the RTC is behind.
+ */
+
+static int ds3231_offset(int i2c,int pps,long long *off)
+{
+	unsigned long seq;
+	struct timespec stamp;
+	time_t t;
 
-		sum/=total;
+	if(ppswait(pps,&seq,&stamp))return -1;
+	if(ds3231_read_time(i2c,&t))return -1;
+	*off=(stamp.tv_sec-t)*1000000000LL+stamp.tv_nsec;
+	return 0;
+}
 
-		if(sum>1000000000)value-=delta;
-		else value+=delta;
-		delta>>=1;
-	}
+/*
+ * Drift and offset files are kept per RTC, key is the i2c bus of the
+ * DS3231 or RTCKEY plus the rtcid of -K.
+ */
+
+static void statefile(char *bfr,int len,char *fmt,int key)
+{
+	if(key>=RTCKEY)snprintf(bfr,len,fmt,"rtc",key-RTCKEY);
+	else snprintf(bfr,len,fmt,"",key);
+}
 
-	*result=value;
+/*
+ * The drift file holds the time of the last RTC write and the offset
+ * measured right after it, the drift rate follows from the next offset.
+ * Every RTC write removes it, only "-s -O" stores a new baseline.
+ */
 
+static int driftload(int key,time_t *when,long long *off)
+{
+	int r;
+	long long w;
+	FILE *fp;
+	char bfr[64];
+
+	statefile(bfr,sizeof(bfr),DRIFTFILE,key);
+	if(!(fp=fopen(bfr,"re")))return -1;
+	r=fscanf(fp,"%lld %lld",&w,off);
+	fclose(fp);
+	if(r!=2)return -1;
+	*when=w;
 	return 0;
 }
 
-int shmrunner(int i2cid,int ppsid,int id,int bg)
+static int driftsave(int key,time_t when,long long off)
+{
+	FILE *fp;
+	char bfr[64];
+
+	mkdir(DRIFTDIR,0755);
+	statefile(bfr,sizeof(bfr),DRIFTFILE,key);
+	if(!(fp=fopen(bfr,"we")))return -1;
+	fprintf(fp,"%lld %lld\n",(long long)when,off);
+	if(fclose(fp))return -1;
+	return 0;
+}
+
+static void driftclear(int key)
+{
+	char bfr[64];
+
+	statefile(bfr,sizeof(bfr),DRIFTFILE,key);
+	unlink(bfr);
+}
+
+/*
+ * ageing history for rtcageing, one "when value" line per change, value
+ * AGE_SWEEP marks the start of an ageing estimation or sweep
+ */
+
+static int agesave(int bus,int value)
+{
+	FILE *fp;
+	char bfr[64];
+
+	mkdir(DRIFTDIR,0755);
+	snprintf(bfr,sizeof(bfr),AGEFILE,bus);
+	if(!(fp=fopen(bfr,"ae")))return -1;
+	fprintf(fp,"%lld %d\n",(long long)time(NULL),value);
+	if(fclose(fp))return -1;
+	return 0;
+}
+
+/*
+ * Ageing sensitivity table measured by "-E", one "temperature sensitivity"
+ * line per whole degree (temperature in 1/100 degrees Celsius, sensitivity
+ * in ppm per ageing step) sorted by temperature. Without a table the
+ * nominal sensitivity is used.
+ */
+
+static int sensload(int bus,struct sensent *tab)
+{
+	int n=0;
+	FILE *fp;
+	char bfr[64];
+
+	snprintf(bfr,sizeof(bfr),SENSFILE,bus);
+	if(!(fp=fopen(bfr,"re")))return 0;
+	while(n<SENS_MAX&&fscanf(fp,"%d %lf",&tab[n].temp,&tab[n].sens)==2)
+	{
+		if(n&&tab[n].temp<=tab[n-1].temp)break;
+		n++;
+	}
+	fclose(fp);
+	return n;
+}
+
+static int senssave(int bus,int temp,double sens)
+{
+	int i;
+	int n;
+	FILE *fp;
+	struct sensent tab[SENS_MAX];
+	char bfr[64];
+
+	n=sensload(bus,tab);
+	for(i=0;i<n&&SENSKEY(tab[i].temp)<SENSKEY(temp);i++);
+	if(i==n||SENSKEY(tab[i].temp)!=SENSKEY(temp))
+	{
+		if(n==SENS_MAX)return -1;
+		memmove(&tab[i+1],&tab[i],(n-i)*sizeof(struct sensent));
+		n++;
+	}
+	tab[i].temp=temp;
+	tab[i].sens=sens;
+
+	mkdir(DRIFTDIR,0755);
+	snprintf(bfr,sizeof(bfr),SENSFILE,bus);
+	if(!(fp=fopen(bfr,"we")))return -1;
+	for(i=0;i<n;i++)fprintf(fp,"%d %.5f\n",tab[i].temp,tab[i].sens);
+	if(fclose(fp))return -1;
+	return 0;
+}
+
+/* sensitivity at the given temperature, linearly interpolated */
+
+static double sensget(int bus,int temp,int *measured)
+{
+	int i;
+	int n;
+	struct sensent tab[SENS_MAX];
+
+	*measured=0;
+	if(!(n=sensload(bus,tab)))return SENS_NOMINAL;
+	*measured=1;
+	if(temp<=tab[0].temp)return tab[0].sens;
+	for(i=1;i<n;i++)if(temp<=tab[i].temp)return tab[i-1].sens+
+		(tab[i].sens-tab[i-1].sens)*(temp-tab[i-1].temp)/
+		(tab[i].temp-tab[i-1].temp);
+	return tab[n-1].sens;
+}
+
+/*
+ * Powered-off drift: "-z" stores the RTC offset at shutdown and marks it
+ * pending. The first "-s -O" after the next boot measures the offset
+ * again, takes off the drift since boot at the frequency estimated by the
+ * running daemon and averages the rest per powered-off hour into rate
+ * (ns per hour). Without a settled daemon frequency (onfreq NULL) the
+ * drift since boot is unknown and nothing is learned. Any RTC write
+ * consumes the pending record. While pending, the offset at boot is
+ * predicted from the shutdown offset and rate.
+ */
+
+static int clksynced(void)
+{
+	struct timex tx;
+
+	memset(&tx,0,sizeof(tx));
+	if(adjtimex(&tx)==TIME_ERROR)return 0;
+	return (tx.status&STA_UNSYNC)?0:1;
+}
+
+static int offload(int key,struct offrec *r)
+{
+	int n;
+	long long w;
+	FILE *fp;
+	char bfr[64];
+
+	memset(r,0,sizeof(struct offrec));
+	statefile(bfr,sizeof(bfr),OFFFILE,key);
+	if(!(fp=fopen(bfr,"re")))return -1;
+	n=fscanf(fp,"%lld %lld %d %d %lf",&w,&r->off,&r->pending,&r->n,
+		&r->rate);
+	fclose(fp);
+	if(n!=5)
+	{
+		memset(r,0,sizeof(struct offrec));
+		return -1;
+	}
+	r->when=w;
+	return 0;
+}
+
+static int offsave(int key,struct offrec *r)
+{
+	FILE *fp;
+	char bfr[64];
+
+	mkdir(DRIFTDIR,0755);
+	statefile(bfr,sizeof(bfr),OFFFILE,key);
+	if(!(fp=fopen(bfr,"we")))return -1;
+	fprintf(fp,"%lld %lld %d %d %.1f\n",(long long)r->when,r->off,
+		r->pending,r->n,r->rate);
+	if(fclose(fp))return -1;
+	return 0;
+}
+
+/* record the offset at shutdown, invalid if the clock is not synchronized */
+
+static int offmark(int key,long long off)
+{
+	struct offrec r;
+
+	offload(key,&r);
+	r.when=time(NULL);
+	r.off=off;
+	r.pending=clksynced();
+	return offsave(key,&r);
+}
+
+/* learn from the offset measured after boot, off is NULL after an RTC write */
+
+static int offlearn(int key,long long *off,double *onfreq)
+{
+	double hours;
+	double rate;
+	struct offrec r;
+	struct timespec up;
+
+	if(offload(key,&r)||!r.pending)return 0;
+	r.pending=0;
+	if(off&&onfreq&&clksynced()&&!clock_gettime(CLOCK_BOOTTIME,&up))
+	{
+		hours=(time(NULL)-up.tv_sec-r.when)/3600.0;
+		if(hours>=OFF_MINHOURS)
+		{
+			rate=(*off-r.off+*onfreq*1000.0*up.tv_sec)/hours;
+			if(rate<OFF_MAXRATE&&rate>-OFF_MAXRATE)
+			{
+				if(r.n<OFF_AVG)r.n++;
+				r.rate+=(rate-r.rate)/r.n;
+			}
+		}
+	}
+	return offsave(key,&r);
+}
+
+/* offset (system minus RTC time) expected at boot for the RTC time t */
+
+static int offpredict(int key,time_t t,long long *corr)
+{
+	struct offrec r;
+
+	if(offload(key,&r)||!r.pending||t<r.when)return -1;
+	*corr=r.off+(long long)(r.rate*(t-r.when)/3600.0);
+	if(llabs(*corr)>OFF_MAXCORR)return -1;
+	return 0;
+}
+
+static int ds3231_get_ageing(int fd,int *value)
+{
+	signed char data;
+
+	if(readi2cbytes(fd,0x10,1,(unsigned char *)&data))return -1;
+	*value=data;
+	return 0;
+}
+
+static int ds3231_set_ageing(int fd,int value)
+{
+	unsigned char ctrl;
+	unsigned char data;
+
+	if(value<-127||value>127)return -1;
+
+	while(1)
+	{
+		while(1)
+		{
+			if(readi2cbytes(fd,0x0e,1,&ctrl))return -1;
+			if(!(ctrl&0x20))break;
+			usleep(1000);
+		}
+
+		while(1)
+		{
+			if(readi2cbytes(fd,0x0f,1,&data))return -1;
+			if(!(data&0x04))break;
+			usleep(1000);
+		}
+
+		data=(unsigned char)value;
+		if(writei2cbytes(fd,0x10,1,&data))return -1;
+
+		ctrl|=0x20;
+		if(writei2cbytes(fd,0x0e,1,&ctrl))return -1;
+
+		if(readi2cbytes(fd,0x0f,1,&data))return -1;
+		if(!(data&0x04))break;
+		usleep(1000);
+	}
+
+	while(1)
+	{
+		if(readi2cbytes(fd,0x0e,1,&ctrl))return -1;
+		if(!(ctrl&0x20))break;
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+static int ds3231_temp(unsigned char *data)
+{
+	int value;
+
+	value=((signed char)data[0])*100;
+	switch(data[1]&0xc0)
+	{
+	case 0x40:
+		if(value<0)value-=25;
+		else value+=25;
+		break;
+	case 0x80:
+		if(value<0)value-=50;
+		else value+=50;
+		break;
+	case 0xc0:
+		if(value<0)value-=75;
+		else value+=75;
+		break;
+	}
+	return value;
+}
+
+static int ds3231_get_temp(int fd,int *value)
+{
+	unsigned char data[2];
+
+	if(readi2cbytes(fd,0x11,2,data))return -1;
+	*value=ds3231_temp(data);
+	return 0;
+}
+
+static int ds3231_decstate(unsigned char *data,struct ctlstate *state)
+{
+	state->pps=(data[0]&0x04)?0:1;
+	state->ageing=(signed char)data[2];
+	state->temp=ds3231_temp(data+3);
+	return (data[1]&0x04)?1:0;
+}
+
+static int ds3231_read_state(int fd,struct ctlstate *state)
+{
+	unsigned char data[5];
+
+	if(readi2cbytes(fd,0x0e,5,data))return -1;
+	ds3231_decstate(data,state);
+	return 0;
+}
+
+/*
+ * Read time, control, status, ageing and temperature in one transaction
+ * so that every second sees the temperature the TCXO is trimmed for,
+ * the time registers are left in data for rtc_decode(). Returns the BSY
+ * bit (conversion in progress) or -1 on error.
+ */
+
+static int ds3231_read_all(int fd,unsigned char *data,
+	struct ctlstate *state)
+{
+	if(readi2cbytes(fd,0x00,19,data))return -1;
+	return ds3231_decstate(data+0x0e,state);
+}
+
+static int ds3231_read_conv(int fd,int *temp)
+{
+	unsigned char data[4];
+
+	if(readi2cbytes(fd,0x0f,4,data))return -1;
+	*temp=ds3231_temp(data+2);
+	return (data[0]&0x04)?1:0;
+}
+
+/*
+ * With dual edge capture the clear edge periods are averaged in as well
+ * and, if clroff is not NULL, the mean delay of the clear edge from the
+ * middle of the second is returned in nanoseconds. If adev is not NULL
+ * the assert edge phase of every ageing step is fed to it. Periods that
+ * contain a TCXO conversion or retrim are not used.
+ */
+
+static int ds3231_estimate_calibration(int i2c,int pps,int iter,int *result,
+	long *clroff,struct adev *adev,
+	int (*callback)(int current,int total,void *param),void *param)
+{
+	int done=0;
+	int rqdsec;
+	int currsec=0;
+	int cnt;
+	int have[2];
+	int bsy;
+	int temp;
+	int skip=0;
+	long long data;
+	long long clrsum=0;
+	unsigned long clrn=0;
+	unsigned long lcl;
+	struct calest c;
+	struct tcxo t;
+	struct ppsedge e;
+	struct timespec ref;
+	struct timespec prev[2];
+
+	rqdsec=(iter+1)*7;
+	memset(&e,0,sizeof(e));
+	calest_init(&c);
+
+	while(1)
+	{
+		if(ds3231_set_ageing(i2c,c.value))return -1;
+
+		if(done)break;
+
+		do
+		{
+			if(ppswaitedge(pps,&e))return -1;
+		} while(e.edge);
+		if(callback)if(callback(++currsec,rqdsec,param))return -1;
+		lcl=e.count;
+		prev[0]=e.stamp;
+		ref=e.stamp;
+		have[0]=1;
+		have[1]=0;
+		tcxo_init(&t);
+		if((bsy=ds3231_read_conv(i2c,&temp))==-1)return -1;
+		tcxo_add(&t,0,0,temp,bsy);
+		if(adev)
+		{
+			adev_gap(adev);
+			adev_add(adev,0);
+		}
+
+		for(cnt=0;cnt<iter;)
+		{
+			if(ppswaitedge(pps,&e))return -1;
+			if(++lcl!=e.count)return -1;
+			if(!e.edge)
+			{
+				cnt++;
+				if(callback)if(callback(++currsec,rqdsec,param))
+					return -1;
+				data=tsdiff(&e.stamp,&ref)-cnt*1000000000LL;
+				if(adev)adev_add(adev,data);
+				if((bsy=ds3231_read_conv(i2c,&temp))==-1)
+					return -1;
+				skip=tcxo_add(&t,cnt,data,temp,bsy)&TCXO_SKIP;
+			}
+			if(e.edge&&have[0])
+			{
+				data=tsdiff(&e.stamp,&prev[0])-500000000;
+				if(data<-100000000||data>100000000)return -1;
+				clrsum+=data;
+				clrn++;
+			}
+			if(have[e.edge])
+			{
+				data=tsdiff(&e.stamp,&prev[e.edge]);
+				if(data<900000000||data>1100000000)return -1;
+				if(!skip)calest_add(&c,data);
+			}
+			prev[e.edge]=e.stamp;
+			have[e.edge]=1;
+		}
+
+		done=calest_step(&c);
+	}
+
+	*result=c.value;
+	if(clroff)*clroff=clrn?clrsum/(long long)clrn:0;
+
+	return 0;
+}
+
+/*
+ * Steps the ageing value from min to max in up to SENS_POINTS steps and
+ * measures the RTC frequency error (ppm, positive if fast) against the
+ * PPS timestamps for SENS_SECS seconds at every step. Samples around TCXO
+ * conversions are skipped and retrims start a new fit segment. Returns
+ * the number of steps and the mean temperature, the ageing value is left
+ * at max.
+ */
+
+static int ds3231_sweep(int i2c,int pps,int min,int max,int *ageing,
+	double *ppm,int *temp,
+	int (*callback)(int current,int total,void *param),void *param)
+{
+	int i;
+	int n;
+	int cnt;
+	int bsy;
+	int tmp;
+	int currsec=0;
+	long long tsum=0;
+	unsigned long lcl;
+	struct tcxo t;
+	struct ppsedge e;
+	struct timespec ref;
+
+	if((n=max-min+1)>SENS_POINTS)n=SENS_POINTS;
+	if(n<2)return -1;
+	memset(&e,0,sizeof(e));
+
+	for(i=0;i<n;i++)
+	{
+		ageing[i]=min+(max-min)*i/(n-1);
+		if(ds3231_set_ageing(i2c,ageing[i]))return -1;
+
+		if(ppswaitedge(pps,&e))return -1;
+		if(callback)if(callback(++currsec,n*(SENS_SECS+1),param))
+			return -1;
+		lcl=e.count;
+		ref=e.stamp;
+		tcxo_init(&t);
+		if((bsy=ds3231_read_conv(i2c,&tmp))==-1)return -1;
+		tcxo_add(&t,0,0,tmp,bsy);
+
+		for(cnt=1;cnt<=SENS_SECS;cnt++)
+		{
+			if(ppswaitedge(pps,&e))return -1;
+			if(++lcl!=e.count)return -1;
+			if(callback)if(callback(++currsec,n*(SENS_SECS+1),
+				param))return -1;
+			if((bsy=ds3231_read_conv(i2c,&tmp))==-1)return -1;
+			tcxo_add(&t,cnt,tsdiff(&e.stamp,&ref)-cnt*1000000000LL,
+				tmp,bsy);
+			tsum+=tmp;
+		}
+
+		if(tcxo_freq(&t,&ppm[i]))return -1;
+		ppm[i]*=1e6;
+	}
+
+	*temp=tsum/(n*SENS_SECS);
+	return n;
+}
+
+static int gpioopen(int chip,int line)
+{
+	int fd;
+	char bfr[32];
+	struct gpio_v2_line_request req;
+
+	if(chip<0||chip>255)goto err1;
+	snprintf(bfr,sizeof(bfr),"/dev/gpiochip%d",chip);
+	if((fd=open(bfr,O_RDWR|O_CLOEXEC))==-1)goto err1;
+	memset(&req,0,sizeof(req));
+	req.offsets[0]=line;
+	req.num_lines=1;
+	req.config.flags=GPIO_V2_LINE_FLAG_INPUT|GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	req.event_buffer_size=GPIO_EVBUF;
+	strncpy(req.consumer,"rtctool",sizeof(req.consumer)-1);
+	if(ioctl(fd,GPIO_V2_GET_LINE_IOCTL,&req))goto err2;
+	close(fd);
+	return req.fd;
+
+err2:	close(fd);
+err1:	return -1;
+}
+
+/*
+ * Timestamps the falling SQW edges for the given time and fits the period
+ * by least squares. The edge index is derived from the timestamp
+ * difference to the previous event, so interrupts lost by the kernel or
+ * events dropped from the event buffer only reduce the sample count and
+ * are reported in missed. The timestamps are CLOCK_MONOTONIC which is
+ * frequency disciplined by NTP.
+ */
+
+static int sqwmeasure(int gpio,int rate,int secs,double *ppm,
+	unsigned long *edges,unsigned long *missed,
+	int (*callback)(int current,int total,void *param),void *param)
+{
+	int i;
+	int n;
+	int sec=0;
+	long long m;
+	unsigned long long t0=0;
+	unsigned long long tp=0;
+	unsigned long long k=0;
+	double period;
+	double slope;
+	struct linfit l;
+	struct pollfd p;
+	struct gpio_v2_line_event ev[64];
+
+	period=1000000000.0/rate;
+	linfit_init(&l);
+	*edges=0;
+	*missed=0;
+	p.fd=gpio;
+	p.events=POLLIN;
+
+	while(sec<secs)
+	{
+		if(poll(&p,1,1000)<1)return -1;
+		if((n=read(gpio,ev,sizeof(ev)))<(int)sizeof(ev[0]))return -1;
+		n/=sizeof(ev[0]);
+
+		for(i=0;i<n;i++)
+		{
+			if(!*edges)t0=ev[i].timestamp_ns;
+			else
+			{
+				m=(ev[i].timestamp_ns-tp)/period+0.5;
+				if(m<1)return -1;
+				*missed+=m-1;
+				k+=m;
+			}
+			tp=ev[i].timestamp_ns;
+			linfit_add(&l,k,tp-t0);
+			++*edges;
+		}
+
+		while(tp-t0>=(sec+1)*1000000000ULL&&sec<secs)
+		{
+			sec++;
+			if(callback)if(callback(sec,secs,param))return -1;
+		}
+	}
+
+	if(linfit_slope(&l,&slope))return -1;
+	*ppm=(period/slope-1.0)*1000000.0;
+	return 0;
+}
+
+static int ppslatency(int pps,int n,long *lat,int *missed,
+	int (*callback)(int current,int total,void *param),void *param)
+{
+	int i;
+	unsigned long seq;
+	unsigned long prv;
+	struct timespec now;
+	struct timespec stamp;
+
+	*missed=0;
+	if(ppswait(pps,&prv,&stamp))return -1;
+
+	for(i=0;i<n;i++)
+	{
+		if(ppswait(pps,&seq,&stamp))return -1;
+		if(clock_gettime(CLOCK_REALTIME,&now))return -1;
+		if(callback)if(callback(i+1,n,param))return -1;
+		*missed+=seq-prv-1;
+		prv=seq;
+		lat[i]=(now.tv_sec-stamp.tv_sec)*1000000000L+
+			now.tv_nsec-stamp.tv_nsec;
+	}
+
+	return 0;
+}
+
+static int rtsetup(int policy,int prio,int cpu)
+{
+	cpu_set_t set;
+	struct sched_param s;
+
+	if(cpu!=-1)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(cpu,&set);
+		if(sched_setaffinity(0,sizeof(set),&set))return -1;
+	}
+	if(prio)s.sched_priority=prio;
+	else s.sched_priority=sched_get_priority_max(policy);
+	if(sched_setscheduler(0,policy,&s))return -1;
+	return 0;
+}
+
+/* the barrier keeps the compiler from dropping the otherwise dead memset */
+
+static void __attribute__((noinline)) rtprefault(void)
+{
+	unsigned char stack[RT_STACK];
+
+	memset(stack,0,sizeof(stack));
+	__asm__ __volatile__(""::"r"(stack):"memory");
+}
+
+/*
+ * Memory locks are not inherited by fork(), so this must be called after
+ * daemonizing. A timer slack of 0 would select the default slack, thus use
+ * the smallest possible nonzero value instead.
+ */
+
+static int rtlock(void)
+{
+	if(mlockall(MCL_CURRENT|MCL_FUTURE))return -1;
+	rtprefault();
+	if(prctl(PR_SET_TIMERSLACK,1UL,0UL,0UL,0UL))return -1;
+	return 0;
+}
+
+static int ctlopen(int bus)
+{
+	int s;
+	int one=1;
+	struct sockaddr_un a;
+
+	memset(&a,0,sizeof(a));
+	a.sun_family=AF_UNIX;
+	snprintf(a.sun_path,sizeof(a.sun_path),CTLSOCK,bus);
+	if((s=socket(PF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK,0))==-1)
+		goto err1;
+	unlink(a.sun_path);
+	if(bind(s,(struct sockaddr *)(&a),sizeof(a)))goto err2;
+	if(chmod(a.sun_path,0666))goto err3;
+	if(setsockopt(s,SOL_SOCKET,SO_PASSCRED,&one,sizeof(one)))goto err3;
+	return s;
+
+err3:	unlink(a.sun_path);
+err2:	close(s);
+err1:	return -1;
+}
+
+static void ctlclose(int s,int bus)
+{
+	char bfr[32];
+
+	snprintf(bfr,sizeof(bfr),CTLSOCK,bus);
+	close(s);
+	unlink(bfr);
+}
+
+static void ntpstamp(struct ntpsrv *n,struct timespec *t,unsigned char *p)
+{
+	long long d;
+	long long sec;
+	unsigned int frac;
+
+	d=tsdiff(t,&n->edge);
+	d+=(long long)(d*n->freq);
+	sec=d/1000000000;
+	if((d%=1000000000)<0)
+	{
+		d+=1000000000;
+		sec--;
+	}
+	sec+=n->rtcsec+NTP_EPOCH;
+	frac=(unsigned int)(((unsigned long long)d<<32)/1000000000);
+	p[0]=(unsigned char)(sec>>24);
+	p[1]=(unsigned char)(sec>>16);
+	p[2]=(unsigned char)(sec>>8);
+	p[3]=(unsigned char)sec;
+	p[4]=(unsigned char)(frac>>24);
+	p[5]=(unsigned char)(frac>>16);
+	p[6]=(unsigned char)(frac>>8);
+	p[7]=(unsigned char)frac;
+}
+
+static int ntpopen(struct ntpsrv *n,int port,int stratum)
+{
+	int one=1;
+	int zero=0;
+	struct sockaddr_in6 a;
+
+	memset(n,0,sizeof(struct ntpsrv));
+	if((n->s=socket(PF_INET6,SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK,0))
+		==-1)goto err1;
+	if(setsockopt(n->s,IPPROTO_IPV6,IPV6_V6ONLY,&zero,sizeof(zero)))
+		goto err2;
+	if(setsockopt(n->s,SOL_SOCKET,SO_TIMESTAMPNS,&one,sizeof(one)))
+		goto err2;
+	memset(&a,0,sizeof(a));
+	a.sin6_family=AF_INET6;
+	a.sin6_port=htons(port);
+	a.sin6_addr=in6addr_any;
+	if(bind(n->s,(struct sockaddr *)(&a),sizeof(a)))goto err2;
+
+	n->tpl[0]=0x24;
+	n->tpl[1]=stratum;
+	n->tpl[3]=(unsigned char)(-20);
+	n->tpl[10]=0x00;
+	n->tpl[11]=0x42;
+	memcpy(n->tpl+12,"RTC",4);
+	return 0;
+
+err2:	close(n->s);
+err1:	return -1;
+}
+
+/*
+ * Called for every published assert edge, the RTC second rtcsec started
+ * at system time edge and the RTC runs fast by freq.
+ */
+
+static void ntpupdate(struct ntpsrv *n,time_t rtcsec,struct timespec *edge,
+	double freq)
+{
+	n->rtcsec=rtcsec;
+	n->edge=*edge;
+	n->freq=freq;
+	ntpstamp(n,edge,n->tpl+16);
+	n->valid=1;
+}
+
+/*
+ * Answer all pending NTPv4 client requests from the template, only the
+ * leap indicator, version, poll, origin, receive and transmit fields are
+ * filled in. The receive time is the kernel timestamp of the request.
+ * Nothing is answered before the first edge, while the last edge is not
+ * current (PPS loss or holdover) the leap indicator is 3 (alarm).
+ */
+
+static void ntpserve(struct ntpsrv *n)
+{
+	unsigned char req[NTP_PKTLEN];
+	unsigned char rpy[NTP_PKTLEN];
+	union
+	{
+		struct cmsghdr align;
+		unsigned char bfr[CMSG_SPACE(sizeof(struct timespec))];
+	} ctl;
+	struct sockaddr_in6 a;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct timespec rx;
+	struct timespec now;
+
+	while(1)
+	{
+		iov.iov_base=req;
+		iov.iov_len=sizeof(req);
+		memset(&msg,0,sizeof(msg));
+		msg.msg_name=&a;
+		msg.msg_namelen=sizeof(a);
+		msg.msg_iov=&iov;
+		msg.msg_iovlen=1;
+		msg.msg_control=ctl.bfr;
+		msg.msg_controllen=sizeof(ctl.bfr);
+		if(recvmsg(n->s,&msg,0)!=NTP_PKTLEN)
+		{
+			if(errno==EAGAIN||errno==EWOULDBLOCK)return;
+			continue;
+		}
+		if(!n->rtcsec||(req[0]&0x07)!=3||!(req[0]&0x38))continue;
+		if(clock_gettime(CLOCK_REALTIME,&rx))return;
+		for(cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg))
+			if(cmsg->cmsg_level==SOL_SOCKET&&
+				cmsg->cmsg_type==SCM_TIMESTAMPNS)
+		{
+			memcpy(&rx,CMSG_DATA(cmsg),sizeof(rx));
+			break;
+		}
+		memcpy(rpy,n->tpl,NTP_PKTLEN);
+		rpy[0]=(req[0]&0x38)|(n->valid?0x04:0xc4);
+		rpy[2]=req[2];
+		memcpy(rpy+24,req+40,8);
+		ntpstamp(n,&rx,rpy+32);
+		clock_gettime(CLOCK_REALTIME,&now);
+		ntpstamp(n,&now,rpy+40);
+		sendto(n->s,rpy,NTP_PKTLEN,MSG_DONTWAIT,(struct sockaddr *)(&a),
+			msg.msg_namelen);
+	}
+}
+
+static void ctlreply(int s,unsigned int cmd,int status,
+	struct sockaddr_un *a,socklen_t alen)
+{
+	struct ctlrpy rpy;
+
+	memset(&rpy,0,sizeof(rpy));
+	rpy.magic=CTL_MAGIC;
+	rpy.cmd=cmd;
+	rpy.status=status;
+	sendto(s,&rpy,sizeof(rpy),MSG_DONTWAIT,(struct sockaddr *)a,alen);
+}
+
+/*
+ * CTL_SETRTC is only accepted from root and answered by the daemon loop
+ * after the RTC was written, pend is NULL if it can't be handled now.
+ */
+
+static void ctlanswer(int s,struct ctlstate *state,struct adev *adev,
+	struct ctlpend *pend)
+{
+	struct ctlreq req;
+	struct ctlrpy rpy;
+	struct sockaddr_un a;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct ucred *cred=NULL;
+	union
+	{
+		struct cmsghdr align;
+		unsigned char bfr[CMSG_SPACE(sizeof(struct ucred))];
+	} ctl;
+
+	iov.iov_base=&req;
+	iov.iov_len=sizeof(req);
+	memset(&msg,0,sizeof(msg));
+	msg.msg_name=&a;
+	msg.msg_namelen=sizeof(a);
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=ctl.bfr;
+	msg.msg_controllen=sizeof(ctl.bfr);
+	if(recvmsg(s,&msg,0)!=sizeof(req))return;
+	if(req.magic!=CTL_MAGIC)return;
+	for(cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg))
+		if(cmsg->cmsg_level==SOL_SOCKET&&
+			cmsg->cmsg_type==SCM_CREDENTIALS)
+			cred=(struct ucred *)CMSG_DATA(cmsg);
+	memset(&rpy,0,sizeof(rpy));
+	rpy.magic=CTL_MAGIC;
+	rpy.cmd=req.cmd;
+	switch(req.cmd)
+	{
+	case CTL_STATE:
+		rpy.u.state=*state;
+		break;
+	case CTL_ADEV:
+		rpy.u.adev.n=adev_get(adev,rpy.u.adev.pt);
+		break;
+	case CTL_SETRTC:
+		if(!pend||pend->cmd||!cred||cred->uid)
+		{
+			rpy.status=-1;
+			break;
+		}
+		pend->cmd=req.cmd;
+		pend->arg=req.arg;
+		pend->a=a;
+		pend->alen=msg.msg_namelen;
+		return;
+	default:rpy.status=-1;
+		break;
+	}
+	sendto(s,&rpy,sizeof(rpy),MSG_DONTWAIT,(struct sockaddr *)(&a),
+		msg.msg_namelen);
+}
+
+/* serve until edge+window or until wake (if not -1) becomes readable */
+
+static void ctlserve(int s,struct ctlstate *state,struct adev *adev,
+	struct ctlpend *pend,struct ntpsrv *ntp,struct timespec *edge,
+	long window,int wake)
+{
+	long ms;
+	struct pollfd p[3];
+	struct timespec now;
+
+	p[0].fd=s;
+	p[0].events=POLLIN;
+	p[1].fd=ntp?ntp->s:-1;
+	p[1].events=POLLIN;
+	p[2].fd=wake;
+	p[2].events=POLLIN;
+
+	while(1)
+	{
+		if(clock_gettime(CLOCK_REALTIME,&now))return;
+		ms=(edge->tv_sec-now.tv_sec)*1000+
+			(edge->tv_nsec+window-now.tv_nsec)/1000000;
+		if(ms<=0)return;
+		if(poll(p,3,ms)<1)return;
+		if(ntp&&(p[1].revents&POLLIN))ntpserve(ntp);
+		if(p[0].revents&POLLIN)ctlanswer(s,state,adev,pend);
+		if(p[2].revents&POLLIN)return;
+	}
+}
+
+static int ctlquery(int bus,int cmd,int arg,struct ctlrpy *rpy)
+{
+	int s;
+	struct ctlreq req;
+	struct sockaddr_un a;
+	struct pollfd p;
+
+	memset(&a,0,sizeof(a));
+	a.sun_family=AF_UNIX;
+	if((s=socket(PF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0))==-1)goto err1;
+	if(bind(s,(struct sockaddr *)(&a),sizeof(sa_family_t)))goto err2;
+	snprintf(a.sun_path,sizeof(a.sun_path),CTLSOCK,bus);
+	if(connect(s,(struct sockaddr *)(&a),sizeof(a)))goto err2;
+	req.magic=CTL_MAGIC;
+	req.cmd=cmd;
+	req.arg=arg;
+	if(send(s,&req,sizeof(req),0)!=sizeof(req))goto err2;
+	p.fd=s;
+	p.events=POLLIN;
+	if(poll(&p,1,3000)<1)goto err2;
+	if(recv(s,rpy,sizeof(*rpy),0)!=sizeof(*rpy))goto err2;
+	if(rpy->magic!=CTL_MAGIC||rpy->cmd!=cmd||rpy->status)goto err2;
+	close(s);
+	return 0;
+
+err2:	close(s);
+err1:	return -1;
+}
+
+static int ctlstate(int bus,struct ctlstate *state)
+{
+	struct ctlrpy rpy;
+	struct timespec now;
+
+	if(ctlquery(bus,CTL_STATE,0,&rpy))return -1;
+	if(clock_gettime(CLOCK_REALTIME,&now))return -1;
+	if(now.tv_sec-rpy.u.state.edge.tv_sec>2)return -1;
+	*state=rpy.u.state;
+	return 0;
+}
+
+/* let the running daemon write the RTC, relaxed as for -S */
+
+static int ctlsetrtc(int bus,int relaxed)
+{
+	struct ctlrpy rpy;
+
+	return ctlquery(bus,CTL_SETRTC,relaxed,&rpy);
+}
+
+static time_t ctlrtctime(struct ctlstate *state)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME,&now);
+	return state->rtcsec+now.tv_sec-state->edge.tv_sec-
+		(now.tv_nsec<state->edge.tv_nsec?1:0);
+}
+
+/*
+ * An existing trace file with a valid header is continued, anything else
+ * is recreated with the default size. The file space is allocated up front
+ * so that writing to the mapping can't fail later on.
+ */
+
+static struct trchdr *trcopen(char *fn)
+{
+	int fd;
+	int init=1;
+	size_t len;
+	struct stat stb;
+	struct trchdr hdr;
+	struct trchdr *trc;
+
+	len=sizeof(struct trchdr)+TRC_RECORDS*sizeof(struct trcrec);
+	if((fd=open(fn,O_RDWR|O_CREAT|O_CLOEXEC,0644))==-1)goto err1;
+	if(fstat(fd,&stb))goto err2;
+	if(pread(fd,&hdr,sizeof(hdr),0)==sizeof(hdr))
+		if(hdr.magic==TRC_MAGIC&&hdr.version==TRC_VERSION&&
+			hdr.recsize==sizeof(struct trcrec)&&hdr.records&&
+			stb.st_size==sizeof(struct trchdr)+
+			(off_t)hdr.records*sizeof(struct trcrec))
+	{
+		len=stb.st_size;
+		init=0;
+	}
+	if(init)if(ftruncate(fd,0))goto err2;
+	if(posix_fallocate(fd,0,len))goto err2;
+	if((trc=mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0))==
+		MAP_FAILED)goto err2;
+	close(fd);
+	if(init)
+	{
+		trc->version=TRC_VERSION;
+		trc->recsize=sizeof(struct trcrec);
+		trc->records=(len-sizeof(struct trchdr))/sizeof(struct trcrec);
+		trc->head=0;
+		__atomic_store_n(&trc->magic,TRC_MAGIC,__ATOMIC_RELEASE);
+	}
+	return trc;
+
+err2:	close(fd);
+err1:	return NULL;
+}
+
+static void trcclose(struct trchdr *trc)
+{
+	munmap(trc,sizeof(struct trchdr)+
+		(size_t)trc->records*sizeof(struct trcrec));
+}
+
+static void trcadd(struct trchdr *trc,struct ppsedge *e,time_t rtc,
+	long i2cns,int temp,int flags)
+{
+	uint64_t head=trc->head;
+	struct trcrec *r=(struct trcrec *)(trc+1)+head%trc->records;
+
+	r->sec=e->stamp.tv_sec;
+	r->nsec=e->stamp.tv_nsec;
+	r->seq=e->count;
+	r->rtcdelta=(flags&TRC_RTC)?rtc-e->stamp.tv_sec:0;
+	r->i2cns=(flags&TRC_RTC)?i2cns:0;
+	r->temp=temp;
+	r->flags=flags|(e->edge?TRC_CLEAR:0);
+	__atomic_store_n(&trc->head,head+1,__ATOMIC_RELEASE);
+}
+
+static void shmpublish(struct shmtm *stm,time_t sec,long nsec,
+	struct timespec *rcv)
+{
+	stm->count++;
+	stm->valid=0;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	stm->clocktssec=sec;
+	stm->clocktsusec=nsec/1000;
+	stm->clocktsnsec=nsec;
+	stm->rcvtssec=rcv->tv_sec;
+	stm->rcvtsusec=rcv->tv_nsec/1000;
+	stm->rcvtsnsec=rcv->tv_nsec;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	stm->count++;
+	stm->valid=1;
+}
+
+static void histadd(struct hist *h,const long long *le,long long v)
+{
+	int i;
+
+	for(i=0;i<HIST_BUCKETS&&v>le[i];i++);
+	h->n[i]++;
+	h->sum+=v/1e9;
+}
+
+static void prthist(FILE *fp,char *name,char *help,struct hist *h,
+	const long long *le)
+{
+	int i;
+	unsigned long n=0;
+
+	fprintf(fp,"# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n",
+		name,name,name,help);
+	for(i=0;i<HIST_BUCKETS;i++)
+	{
+		n+=h->n[i];
+		fprintf(fp,"%s_bucket{le=\"%g\"} %lu\n",name,le[i]/1e9,n);
+	}
+	n+=h->n[i];
+	fprintf(fp,"%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n",
+		name,n,name,h->sum,name,n);
+}
+
+static void prtcounter(FILE *fp,char *name,char *help,unsigned long v)
+{
+	fprintf(fp,"# TYPE %s counter\n# HELP %s %s\n%s_total %lu\n",
+		name,name,help,name,v);
+}
+
+/* daemon state as OpenMetrics text, all values are cached by the daemon */
+
+static int prtmetrics(FILE *fp,struct ctlstate *st)
+{
+	prthist(fp,"rtctool_pps_jitter_seconds","PPS interval deviation "
+		"from one second",&st->jitter,jitterle);
+	prthist(fp,"rtctool_i2c_latency_seconds","I2C read time after a PPS "
+		"edge",&st->i2clat,i2clatle);
+	prtcounter(fp,"rtctool_missed_edges","Missed PPS edges",st->missed);
+	prtcounter(fp,"rtctool_pps_timeouts","PPS timeouts",st->timeouts);
+	prtcounter(fp,"rtctool_pps_errors","PPS device errors",st->ppserr);
+	prtcounter(fp,"rtctool_i2c_errors","I2C errors",st->i2cerr);
+	prtcounter(fp,"rtctool_reopens","Device reopens",st->reopen);
+	prtcounter(fp,"rtctool_rtc_writes","RTC writes",st->rtcsets);
+	prtcounter(fp,"rtctool_tcxo_retrims","TCXO retrims",st->tcxosteps);
+	prtcounter(fp,"rtctool_ring_overruns","Capture ring overruns",
+		st->overruns);
+	prtcounter(fp,"rtctool_filter_outliers","Rejected filter outliers",
+		st->outliers);
+	prtcounter(fp,"rtctool_holdover_samples","Predicted samples during "
+		"PPS loss",st->holdover);
+	fprintf(fp,"# TYPE rtctool_rtc_offset_seconds gauge\n"
+		"# UNIT rtctool_rtc_offset_seconds seconds\n"
+		"# HELP rtctool_rtc_offset_seconds System time minus RTC time "
+		"at the last PPS edge\n"
+		"rtctool_rtc_offset_seconds %.9f\n",st->offset/1e9);
+	fprintf(fp,"# TYPE rtctool_temperature_celsius gauge\n"
+		"# UNIT rtctool_temperature_celsius celsius\n"
+		"# HELP rtctool_temperature_celsius RTC chip temperature\n"
+		"rtctool_temperature_celsius %.2f\n",st->temp/100.0);
+	fprintf(fp,"# TYPE rtctool_ageing gauge\n"
+		"# HELP rtctool_ageing RTC ageing register value\n"
+		"rtctool_ageing %d\n",st->ageing);
+	fprintf(fp,"# TYPE rtctool_health gauge\n"
+		"# HELP rtctool_health 2 locked to PPS, 1 holdover, 0 no "
+		"valid time\nrtctool_health %d\n",st->health);
+	fprintf(fp,"# TYPE rtctool_filter_frequency_ppm gauge\n"
+		"# HELP rtctool_filter_frequency_ppm Filtered RTC frequency "
+		"error\nrtctool_filter_frequency_ppm %.6f\n",st->kffreq);
+	fprintf(fp,"# EOF\n");
+	return ferror(fp)?-1:0;
+}
+
+/* replace the textfile atomically for the node exporter */
+
+static int metricsave(char *fn,struct ctlstate *st)
+{
+	FILE *fp;
+	char bfr[PATH_MAX];
+
+	if(snprintf(bfr,sizeof(bfr),"%s.tmp",fn)>=sizeof(bfr))return -1;
+	if(!(fp=fopen(bfr,"we")))return -1;
+	if(prtmetrics(fp,st))
+	{
+		fclose(fp);
+		goto err;
+	}
+	if(fclose(fp))goto err;
+	if(rename(bfr,fn))goto err;
+	return 0;
+
+err:	unlink(bfr);
+	return -1;
+}
+
+/*
+ * Predicted RTC time for now from the Kalman filter running against
+ * CLOCK_MONOTONIC_RAW, published while PPS is lost. Gives up after hold
+ * seconds without update or when the predicted error exceeds KF_MAXSIGMA.
+ */
+
+static int kfholdover(struct kf *k,struct shmtm *stm,struct timespec *raw0,
+	time_t rtc0,int hold,struct ctlstate *state)
+{
+	long long ns;
+	double x;
+	double sigma;
+	struct timespec rn;
+	struct timespec rr;
+
+	if(!hold||k->n<KF_WARMUP)return -1;
+	clock_gettime(CLOCK_REALTIME,&rn);
+	clock_gettime(CLOCK_MONOTONIC_RAW,&rr);
+	ns=tsdiff(&rr,raw0);
+	if(ns/1000000000.0-k->t>hold)return -1;
+	kf_predict(k,ns/1000000000.0,&x,&sigma);
+	if(sigma>KF_MAXSIGMA)return -1;
+	ns-=(long long)x;
+	shmpublish(stm,rtc0+ns/1000000000,ns%1000000000,&rn);
+	state->kfsigma=sigma;
+	state->holdover++;
+	return 0;
+}
+
+/*
+ * PPS capture thread, the single producer of the event ring. It does
+ * nothing but wait for PPS edges and post them, so its latency does not
+ * depend on I2C transfers or publishing done by the consumer. If the ring
+ * is full the event is dropped and counted, the consumer then sees a gap
+ * in the edge count. A missing device is retried with exponential backoff.
+ * After an RTC write the consumer sets gap, the one timeout the write
+ * causes is then not posted.
+ */
+
+static void ppspost(struct ppsring *r,int type)
+{
+	unsigned int head=r->head;
+	uint64_t one=1;
+
+	if(head-__atomic_load_n(&r->tail,__ATOMIC_ACQUIRE)==PPS_RING)
+	{
+		__atomic_store_n(&r->overrun,r->overrun+1,__ATOMIC_RELAXED);
+		return;
+	}
+	r->ev[head&(PPS_RING-1)].type=type;
+	r->ev[head&(PPS_RING-1)].e=r->e;
+	__atomic_store_n(&r->head,head+1,__ATOMIC_RELEASE);
+	if(write(r->efd,&one,sizeof(one))!=sizeof(one))return;
+}
+
+static void *ppscapture(void *arg)
+{
+	int wait=1;
+	struct ppsring *r=arg;
+
+	if(r->lock)
+	{
+		rtprefault();
+		prctl(PR_SET_TIMERSLACK,1UL,0UL,0UL,0UL);
+	}
+
+	while(1)
+	{
+		if(r->pps==-1)
+		{
+			if((r->pps=ppsopen(r->ppsid,r->dual))==-1)
+			{
+				ppspost(r,PPSEV_NODEV);
+				sleep(wait);
+				if(wait<RECONNECT_MAX)wait<<=1;
+				continue;
+			}
+			wait=1;
+			ppspost(r,PPSEV_REOPEN);
+		}
+		if(!ppswaitedge(r->pps,&r->e))
+		{
+			__atomic_store_n(&r->gap,0,__ATOMIC_RELAXED);
+			ppspost(r,PPSEV_EDGE);
+		}
+		else if(errno==ETIMEDOUT||errno==EINTR)
+		{
+			if(!__atomic_exchange_n(&r->gap,0,__ATOMIC_RELAXED))
+				ppspost(r,PPSEV_TIMEOUT);
+		}
+		else
+		{
+			ppspost(r,PPSEV_ERROR);
+			close(r->pps);
+			r->pps=-1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Consumer side, returns -1 if no event is available. The nonblocking
+ * eventfd is then reset and becomes readable with the next event.
+ */
+
+static int ppsget(struct ppsring *r,struct ppsevt *v)
+{
+	unsigned int tail=r->tail;
+	uint64_t cnt;
+
+	if(tail==__atomic_load_n(&r->head,__ATOMIC_ACQUIRE))
+	{
+		if(read(r->efd,&cnt,sizeof(cnt))==-1)return -1;
+		if(tail==__atomic_load_n(&r->head,__ATOMIC_ACQUIRE))return -1;
+	}
+	*v=r->ev[tail&(PPS_RING-1)];
+	__atomic_store_n(&r->tail,tail+1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Assert edges during a TCXO conversion or next to a retrim are not
+ * published to keep conversion glitches away from chrony.
+ *
+ * With dual edge capture the clear edge is published as well, using the
+ * RTC second of the preceding assert edge. The delay of the clear edge
+ * from the middle of the second is calibrated by averaging over the first
+ * CLR_CALIB edges and then tracked by a slow moving average, clear edges
+ * are only published after the initial calibration. The clear edge after
+ * a skipped assert edge is skipped as well.
+ *
+ * The phase of every clean assert edge is fed to a Kalman filter tracking
+ * RTC phase, frequency and drift against CLOCK_MONOTONIC_RAW, which is not
+ * affected by chrony steering the system clock. A TCXO retrim adds
+ * frequency uncertainty. With hold set the filtered edge time is published
+ * once the filter is settled, and while PPS is lost predicted samples are
+ * published for up to hold seconds. The filter frequency is relative to
+ * the host oscillator, for reporting it is corrected by the rate of the
+ * disciplined system clock against CLOCK_MONOTONIC_RAW, averaged over
+ * consecutive edges (samples of a system clock step are dropped).
+ */
+
+#define CLR_CALIB 64
+#define CLR_SHIFT 8
+
+/*
+ * With jump set the system clock is stepped to the RTC time at the first
+ * clean assert edge, completing a quick boot by "rtctool -q -r". To not
+ * delay the boot the daemon then detaches before waiting for any edge.
+ * If the system time is already synchronised (a service restart) jump is
+ * ignored, as is -q -r.
+ *
+ * A missed edge, PPS timeout or bad RTC read invalidates the SHM sample
+ * and the daemon resynchronises on the next clean edge. The same is done
+ * after an RTC write requested via the control socket, the write takes
+ * place at the next system second boundary after the control window.
+ * The write restarts the RTC countdown chain, so the next edge is two
+ * seconds after the last one, the capture thread ignores the single PPS
+ * timeout caused by this and the edge count is taken over from the first
+ * edge after the write, which is published. The Kalman filter keeps its
+ * frequency and drift state across the write, its phase is moved to that
+ * edge, which is not used as a measurement. Holdover is suspended until
+ * then. A failing device
+ * is closed and reopened, with exponential backoff up to RECONNECT_MAX
+ * seconds while it is missing. All events are counted in the state.
+ *
+ * After startup PPS is captured by ppscapture() running at the realtime
+ * priority of the daemon, this thread drops to one priority level below
+ * and consumes the edges from the ring. An assert edge that is consumed
+ * too late to still read the matching RTC second is counted as missed.
+ * While waiting for the next event the control socket is served, so
+ * clients get an answer while PPS is lost, too. An RTC write requested
+ * then is done at the next PPS timeout or error.
+ */
+
+int shmrunner(struct shmcfg *cfg)
 {
 	int shmid;
 	int pps;
 	int i2c;
-	time_t now;
-	unsigned long seq;
+	int ctl;
+	int anchor=0;
+	int jump=cfg->jump;
+	int sync=1;
+	int wait=1;
+	int policy;
+	int bsy;
+	int conv=0;
+	int reanchor=0;
+	int kok;
+	unsigned int ncal=0;
+	long window;
+	long long d;
+	long long clroff=0;
+	long long corr;
+	long long kz=0;
+	double freq;
+	double kt=0;
+	double kx;
+	double ksig;
+	double host;
+	double hostppm=0;
+	unsigned int nhost=0;
+	time_t now=0;
+	time_t rtc0=0;
+	time_t mwr=0;
 	unsigned long prv;
+	pthread_t tid;
+	struct sched_param sp;
 	struct group *gr;
 	struct shmtm *stm;
-	struct timespec tv;
-	struct tm tm;
-
+	struct timespec last;
+	struct timespec t0;
+	struct timespec t1;
+	struct timespec raw0;
+	struct timespec raw;
+	struct timespec lastraw;
+	struct timespec rcv;
+	unsigned char rtc[19];
+	struct ppsedge e;
+	struct ppsevt v;
+	struct ppsring *ring;
+	struct ctlstate state;
+	struct tcxo tcxo;
+	struct kf kf;
+	struct rtcshmdata q;
+	struct ctlpend pend;
+	struct ntpsrv ntp;
+	struct adev *adev;
+	struct trchdr *trc=NULL;
+
+	memset(&q,0,sizeof(q));
 	if(getuid()&&geteuid())goto err1;
 	if(!(gr=getgrnam("_chrony")))goto err1;
 	if(setgid(gr->gr_gid))goto err1;
-	if((shmid=shmget((key_t)(0x4e545030+id),sizeof(struct shmtm),
+	if((shmid=shmget((key_t)(0x4e545030+cfg->ntpid),sizeof(struct shmtm),
 		(int)(IPC_CREAT|0660)))==-1)goto err1;
 	if((stm=(struct shmtm *)shmat(shmid,0,0))==(void *)(-1))goto err1;
 	memset(stm,0,sizeof(struct shmtm));
 	stm->mode=1;
 	stm->precision=-20;
 	stm->nsamples=3;
-	if((pps=ppsopen(ppsid))==-1)goto err2;
-	if((i2c=ds3231_open(i2cid))==-1)goto err3;
-	if(ppswait(pps,&prv,&tv))goto err4;
-	if(bg)if(daemon(0,0))goto err4;
+	window=cfg->dual?CTL_DUALWINDOW:CTL_WINDOW;
+	memset(&e,0,sizeof(e));
+	if((pps=ppsopen(cfg->ppsid,cfg->dual))==-1)goto err2;
+	if((i2c=ds3231_open(cfg->i2cid))==-1)goto err3;
+	memset(&state,0,sizeof(state));
+	if(ds3231_read_state(i2c,&state))goto err4;
+	tcxo_init(&tcxo);
+	kf_init(&kf,KF_R,KF_Q0,KF_Q1,KF_Q2);
+	if(jump&&clksynced())jump=0;
+	if(!jump||offpredict(cfg->i2cid,time(NULL),&corr))corr=0;
+	memset(&pend,0,sizeof(pend));
+	if(!(adev=malloc(sizeof(struct adev))))goto err4;
+	adev_init(adev,1.0);
+	if((ctl=ctlopen(cfg->i2cid))==-1)goto err5;
+	if(cfg->trace)if(!(trc=trcopen(cfg->trace)))goto err6;
+	if(cfg->ntpport)if(ntpopen(&ntp,cfg->ntpport,cfg->stratum))goto err7;
+	if(cfg->bg&&jump)if(daemon(0,0))goto err8;
+	if(ppswaitedge(pps,&e))goto err8;
+	prv=e.count;
+	if(cfg->bg&&!jump)if(daemon(0,0))goto err8;
+	if(cfg->lock)if(rtlock())goto err8;
+	rtcshm_publish(cfg->i2cid,&q);
+	if(!(ring=malloc(sizeof(struct ppsring))))goto err8;
+	memset(ring,0,sizeof(struct ppsring));
+	ring->pps=pps;
+	ring->ppsid=cfg->ppsid;
+	ring->dual=cfg->dual;
+	ring->lock=cfg->lock;
+	ring->e=e;
+	if((ring->efd=eventfd(0,EFD_CLOEXEC|EFD_NONBLOCK))==-1)goto err9;
+	if(pthread_create(&tid,NULL,ppscapture,ring))goto err10;
+	if(!pthread_getschedparam(pthread_self(),&policy,&sp)&&
+		policy!=SCHED_OTHER&&sp.sched_priority>1)
+	{
+		sp.sched_priority--;
+		pthread_setschedparam(pthread_self(),policy,&sp);
+	}
 
 	while(1)
 	{
-		if(ppswait(pps,&seq,&tv))goto err4;
-		if(++prv!=seq)goto err4;
-		if(ds3231_read_time(i2c,&tm))goto err4;
-		if((now=timegm(&tm))==(time_t)(-1))goto err4;
-		stm->count++;
-		stm->valid=0;
-		__atomic_thread_fence(__ATOMIC_SEQ_CST);
-		stm->clocktssec=now;
-		stm->clocktsusec=0;
-		stm->clocktsnsec=0;
-		stm->rcvtssec=tv.tv_sec;
-		stm->rcvtsusec=tv.tv_nsec/1000;
-		stm->rcvtsnsec=tv.tv_nsec;
-		__atomic_thread_fence(__ATOMIC_SEQ_CST);
-		stm->count++;
-		stm->valid=1;
+		if(i2c==-1)
+		{
+			if((i2c=ds3231_open(cfg->i2cid))==-1)goto backoff;
+			state.reopen++;
+		}
+		wait=1;
+
+		while(ppsget(ring,&v))
+		{
+			clock_gettime(CLOCK_REALTIME,&t0);
+			t0.tv_sec+=RECONNECT_MAX;
+			ctlserve(ctl,&state,adev,&pend,cfg->ntpport?&ntp:NULL,
+				&t0,0,ring->efd);
+		}
+		state.overruns=__atomic_load_n(&ring->overrun,__ATOMIC_RELAXED);
+		switch(v.type)
+		{
+		case PPSEV_TIMEOUT:
+			state.timeouts++;
+			sync=0;
+			if(pend.cmd)goto setrtc;
+			goto resync;
+
+		case PPSEV_ERROR:
+			state.ppserr++;
+			sync=0;
+			if(pend.cmd)goto setrtc;
+			goto resync;
+
+		case PPSEV_REOPEN:
+			state.reopen++;
+			sync=0;
+			continue;
+
+		case PPSEV_NODEV:
+			sync=0;
+			if(pend.cmd)goto setrtc;
+			goto resync;
+		}
+		e=v.e;
+		if(reanchor)
+		{
+			prv=e.count;
+			sync=1;
+		}
+		else if(!sync||++prv!=e.count)
+		{
+			if(sync)state.missed++;
+			prv=e.count;
+			sync=1;
+			goto resync;
+		}
+		if(!e.edge)
+		{
+			i2carb_edge(cfg->i2cid,&e.stamp);
+			clock_gettime(CLOCK_REALTIME,&rcv);
+			clock_gettime(CLOCK_MONOTONIC_RAW,&raw);
+			if(tsdiff(&rcv,&e.stamp)>CTL_WINDOW)
+			{
+				state.missed++;
+				goto resync;
+			}
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			if((bsy=ds3231_read_all(i2c,rtc,&state))==-1)
+			{
+				state.i2cerr++;
+				close(i2c);
+				i2c=-1;
+				goto resync;
+			}
+			clock_gettime(CLOCK_MONOTONIC,&t1);
+			if(rtc_decode(rtc,&now))
+			{
+				state.i2cerr++;
+				goto resync;
+			}
+			d=(e.stamp.tv_sec-now)*1000000000LL+e.stamp.tv_nsec;
+			raw.tv_sec-=rcv.tv_sec-e.stamp.tv_sec;
+			raw.tv_nsec-=rcv.tv_nsec-e.stamp.tv_nsec;
+			if(!kf.n)
+			{
+				raw0=raw;
+				rtc0=now;
+			}
+			if(jump)
+			{
+				jump=0;
+				clkstep(corr-d);
+				sync=0;
+				goto resync;
+			}
+			conv=tcxo_add(&tcxo,now,d,state.temp,bsy);
+			if(conv&TCXO_STEP)kf_step(&kf,KF_TSTEP);
+			kok=0;
+			if(!(conv&TCXO_SKIP))
+			{
+				kt=tsdiff(&raw,&raw0)/1000000000.0;
+				kz=tsdiff(&raw,&raw0)-(now-rtc0)*1000000000LL;
+				if(reanchor)
+				{
+					kf_predict(&kf,kt,&kx,&ksig);
+					kf_shift(&kf,kz-kx);
+					reanchor=0;
+				}
+				else if(kf_update(&kf,kt,kz))state.outliers++;
+				else kok=1;
+				rcv=e.stamp;
+				if(cfg->hold&&kf.n>=KF_WARMUP)
+				{
+					kf_predict(&kf,kt,&kx,&ksig);
+					rcv.tv_nsec+=(long)kx-kz;
+					while(rcv.tv_nsec<0)
+					{
+						rcv.tv_nsec+=1000000000;
+						rcv.tv_sec--;
+					}
+					while(rcv.tv_nsec>=1000000000)
+					{
+						rcv.tv_nsec-=1000000000;
+						rcv.tv_sec++;
+					}
+				}
+				shmpublish(stm,now,0,&rcv);
+				if(cfg->ntpport)
+				{
+					if(tcxo_freq(&tcxo,&freq))freq=0;
+					ntpupdate(&ntp,now,&rcv,freq);
+				}
+			}
+			if(anchor)
+			{
+				histadd(&state.jitter,jitterle,
+					llabs(tsdiff(&e.stamp,&last)-1000000000));
+				host=((double)tsdiff(&raw,&lastraw)/
+					tsdiff(&e.stamp,&last)-1)*1e6;
+				if(host<HOST_MAXPPM&&host>-HOST_MAXPPM)
+				{
+					if(nhost<HOST_AVG)nhost++;
+					hostppm+=(host-hostppm)/nhost;
+				}
+			}
+			histadd(&state.i2clat,i2clatle,tsdiff(&t1,&t0));
+			state.offset=d;
+			last=e.stamp;
+			lastraw=raw;
+			anchor=1;
+			adev_add(adev,d);
+			state.rtcsec=now;
+			state.edge=e.stamp;
+			state.tcxosteps=tcxo.steps;
+			state.tcxostep=tcxo.step;
+			if(kf.n>1)
+			{
+				kf_predict(&kf,kf.t,&kx,&ksig);
+				state.kffreq=-kf.x[1]/1000.0+hostppm;
+				state.kfsigma=ksig;
+			}
+			state.freqok=kf.n>=KF_WARMUP&&nhost>=HOST_AVG;
+			state.health=2;
+			q.flags=RTCSHM_VALID|((conv&TCXO_SKIP)?RTCSHM_TCXO:0);
+			q.temp=state.temp;
+			q.edge_sec=e.stamp.tv_sec;
+			q.edge_nsec=e.stamp.tv_nsec;
+			q.rtc_sec=now;
+			q.offset=d;
+			q.uncertainty=KF_RSIGMA;
+			q.freq=kf.n>1?(int64_t)(state.kffreq*1000000.0):0;
+			if(kf.n>=KF_WARMUP&&kok)
+			{
+				kf_predict(&kf,kt,&kx,&ksig);
+				q.flags|=RTCSHM_FILTER;
+				q.offset+=(long long)kx-kz;
+				q.uncertainty=ksig;
+			}
+			rtcshm_publish(cfg->i2cid,&q);
+			if(trc)trcadd(trc,&e,now,tsdiff(&t1,&t0),state.temp,
+				TRC_RTC|TRC_TEMP|((conv&TCXO_SKIP)?TRC_CONV:0)|
+				((conv&TCXO_STEP)?TRC_STEP:0));
+			if(cfg->metrics&&t1.tv_sec-mwr>=METRICS_INTERVAL)
+			{
+				metricsave(cfg->metrics,&state);
+				mwr=t1.tv_sec;
+			}
+		}
+		else if(anchor&&cfg->dual)
+		{
+			d=tsdiff(&e.stamp,&last)-500000000;
+			if(d<-100000000||d>100000000)
+			{
+				state.missed++;
+				goto resync;
+			}
+			if(conv&TCXO_SKIP)
+			{
+				if(trc)trcadd(trc,&e,0,0,state.temp,TRC_CONV);
+				goto clrdone;
+			}
+			if(ncal<CLR_CALIB)
+			{
+				clroff+=d;
+				if(++ncal==CLR_CALIB)clroff/=CLR_CALIB;
+			}
+			else
+			{
+				clroff+=(d-clroff)/(1<<CLR_SHIFT);
+				shmpublish(stm,now,500000000+clroff,&e.stamp);
+			}
+			if(trc)trcadd(trc,&e,0,0,state.temp,0);
+		}
+clrdone:	ctlserve(ctl,&state,adev,&pend,cfg->ntpport?&ntp:NULL,&e.stamp,
+			window,-1);
+		if(!pend.cmd)continue;
+
+setrtc:		bsy=ds3231_systohc(i2c,pend.arg,1);
+		if(!bsy)
+		{
+			__atomic_store_n(&ring->gap,1,__ATOMIC_RELAXED);
+			driftclear(cfg->i2cid);
+		}
+		ctlreply(ctl,pend.cmd,bsy,&pend.a,pend.alen);
+		pend.cmd=0;
+		state.rtcsets++;
+		tcxo_gap(&tcxo);
+		reanchor=1;
+		goto resync;
+
+backoff:	clock_gettime(CLOCK_REALTIME,&t0);
+		t0.tv_sec+=wait;
+		ctlserve(ctl,&state,adev,NULL,cfg->ntpport?&ntp:NULL,&t0,0,-1);
+		if(wait<RECONNECT_MAX)wait<<=1;
+
+resync:		if(reanchor||kfholdover(&kf,stm,&raw0,rtc0,cfg->hold,&state))
+		{
+			stm->valid=0;
+			q.flags=0;
+		}
+		else
+		{
+			q.flags=RTCSHM_VALID|RTCSHM_FILTER|RTCSHM_HOLDOVER;
+			q.uncertainty=state.kfsigma;
+		}
+		rtcshm_publish(cfg->i2cid,&q);
+		if(cfg->ntpport)ntp.valid=0;
+		anchor=0;
+		adev_gap(adev);
+		state.health=q.flags?1:0;
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		if(cfg->metrics&&t1.tv_sec-mwr>=METRICS_INTERVAL)
+		{
+			metricsave(cfg->metrics,&state);
+			mwr=t1.tv_sec;
+		}
 	}
 
+err10:	close(ring->efd);
+err9:	free(ring);
+err8:	if(cfg->ntpport)close(ntp.s);
+err7:	if(trc)trcclose(trc);
+err6:	ctlclose(ctl,cfg->i2cid);
+err5:	free(adev);
 err4:	close(i2c);
 err3:	close(pps);
 err2:	stm->valid=0;
 	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 	shmdt(stm);
+	q.flags=0;
+	rtcshm_publish(cfg->i2cid,&q);
+err1:	return -1;
+}
+
+/*
+ * Discovery: all i2c adapters are probed in parallel for a DS3231 at 0x68
+ * (rtc is -1 if the address is bound to a kernel driver) and for EEPROMs
+ * at 0x50-0x57. The PPS device of an RTC is the one that stops seeing
+ * edges while the SQW output of the RTC is disabled. The first RTC with
+ * a PPS device is stored in CONFFILE and used as default by later starts.
+ */
+
+static int icmp(const void *p1,const void *p2)
+{
+	return *((int *)p1)-*((int *)p2);
+}
+
+static int devlist(char *prefix,int *list)
+{
+	int n=0;
+	int len=strlen(prefix);
+	char *end;
+	DIR *d;
+	struct dirent *e;
+
+	if(!(d=opendir("/dev")))return 0;
+	while(n<DISC_MAX&&(e=readdir(d)))
+		if(!strncmp(e->d_name,prefix,len)&&e->d_name[len])
+	{
+		list[n]=strtol(e->d_name+len,&end,10);
+		if(!*end&&list[n]>=0&&list[n]<=255)n++;
+	}
+	closedir(d);
+	qsort(list,n,sizeof(int),icmp);
+	return n;
+}
+
+static int i2cprobe(int fd)
+{
+	struct i2c_smbus_ioctl_data ctl;
+	union i2c_smbus_data data;
+
+	ctl.read_write=I2C_SMBUS_READ;
+	ctl.command=0;
+	ctl.size=I2C_SMBUS_BYTE;
+	ctl.data=&data;
+	i2carb_lock(fd,i2cprio);
+	if(ioctl(fd,I2C_SMBUS,&ctl)==-1)
+	{
+		i2carb_unlock(fd);
+		return -1;
+	}
+	i2carb_unlock(fd);
+	return 0;
+}
+
+static void *busprobe(void *arg)
+{
+	int i;
+	int fd;
+	unsigned char data[19];
+	struct busprobe *b=arg;
+
+	if((fd=ds3231_open(b->bus))==-1)
+	{
+		if(errno==EBUSY)b->rtc=-1;
+	}
+	else
+	{
+		if(!readi2cbytes(fd,0x00,19,data)&&!(data[0x0f]&0x70)&&
+			!(data[0x12]&0x3f)&&rtc_bcd2bin[data[0]]>=0&&
+			rtc_bcd2bin[data[1]]>=0)b->rtc=1;
+		close(fd);
+	}
+	for(i=0;i<8;i++)if((fd=openi2cdev(b->bus,0x50+i))!=-1)
+	{
+		if(!i2cprobe(fd))b->eeprom|=1<<i;
+		close(fd);
+	}
+	return NULL;
+}
+
+static void ppsseq(int *fd,unsigned long *seq,int n)
+{
+	int i;
+	struct pps_fdata data;
+
+	for(i=0;i<n;i++)
+	{
+		seq[i]=0;
+		if(fd[i]==-1)continue;
+		memset(&data,0,sizeof(data));
+		data.timeout.flags=~PPS_TIME_INVALID;
+		if(!ioctl(fd[i],PPS_FETCH,&data))
+			seq[i]=data.info.assert_sequence;
+	}
+}
+
+/*
+ * Opens a PPS device for discovery without changing its setup, only if
+ * assert capture is off it is switched on and set is 1, the caller then
+ * has to restore parm before closing.
+ */
+
+static int ppsprobe(int id,struct pps_kparams *parm,int *set)
+{
+	int fd;
+	int caps;
+	char bfr[32];
+	struct pps_kparams p;
+
+	*set=0;
+	snprintf(bfr,sizeof(bfr),"/dev/pps%d",id);
+	if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)goto err1;
+	if(ioctl(fd,PPS_GETCAP,&caps))goto err2;
+	if(!(caps&PPS_CAPTUREASSERT))goto err2;
+	if(ioctl(fd,PPS_GETPARAMS,parm))goto err2;
+	if(!(parm->mode&PPS_CAPTUREASSERT))
+	{
+		p=*parm;
+		p.mode|=PPS_CAPTUREASSERT;
+		if(ioctl(fd,PPS_SETPARAMS,&p))goto err2;
+		*set=1;
+	}
+	return fd;
+
+err2:	close(fd);
 err1:	return -1;
 }
 
+static int ppsmatch(int i2c,int *pps,int n)
+{
+	int i;
+	int m;
+	int match=-1;
+	int fd[DISC_MAX];
+	int set[DISC_MAX];
+	struct pps_kparams parm[DISC_MAX];
+	unsigned long s0[DISC_MAX];
+	unsigned long s1[DISC_MAX];
+	unsigned long s2[DISC_MAX];
+	unsigned long s3[DISC_MAX];
+	struct timespec ts;
+
+	if((m=ds3231_pps(i2c,-1))==-1)return -1;
+	if(!m)if(ds3231_pps(i2c,1))return -1;
+	for(i=0;i<n;i++)fd[i]=ppsprobe(pps[i],&parm[i],&set[i]);
+	ts.tv_sec=2;
+	ts.tv_nsec=500000000;
+	ppsseq(fd,s0,n);
+	nanosleep(&ts,NULL);
+	ppsseq(fd,s1,n);
+	if(ds3231_pps(i2c,0))goto out;
+	ts.tv_sec=1;
+	nanosleep(&ts,NULL);
+	ppsseq(fd,s2,n);
+	ts.tv_sec=2;
+	nanosleep(&ts,NULL);
+	ppsseq(fd,s3,n);
+	for(i=0;i<n;i++)if(fd[i]!=-1&&s1[i]!=s0[i]&&s3[i]==s2[i])
+	{
+		if(match!=-1)
+		{
+			match=-1;
+			break;
+		}
+		match=pps[i];
+	}
+
+out:	ds3231_pps(i2c,m);
+	for(i=0;i<n;i++)if(fd[i]!=-1)
+	{
+		if(set[i])ioctl(fd[i],PPS_SETPARAMS,&parm[i]);
+		close(fd[i]);
+	}
+	return match;
+}
+
+static int confload(int *i2c,int *pps)
+{
+	int r;
+	FILE *fp;
+
+	if(!(fp=fopen(CONFFILE,"re")))return -1;
+	r=fscanf(fp,"%d %d",i2c,pps);
+	fclose(fp);
+	return r==2?0:-1;
+}
+
+static int confsave(int i2c,int pps)
+{
+	FILE *fp;
+
+	mkdir(DRIFTDIR,0755);
+	if(!(fp=fopen(CONFFILE,"we")))return -1;
+	fprintf(fp,"%d %d\n",i2c,pps);
+	if(fclose(fp))return -1;
+	return 0;
+}
+
+static int discover(void)
+{
+	int i;
+	int j;
+	int n;
+	int np;
+	int fd;
+	int saved=0;
+	int thr[DISC_MAX];
+	int bus[DISC_MAX];
+	int pps[DISC_MAX];
+	pthread_t tid[DISC_MAX];
+	struct busprobe b[DISC_MAX];
+	struct ctlstate st;
+
+	n=devlist("i2c-",bus);
+	np=devlist("pps",pps);
+	for(i=0;i<n;i++)
+	{
+		memset(&b[i],0,sizeof(struct busprobe));
+		b[i].bus=bus[i];
+		b[i].pps=-1;
+		if((thr[i]=!pthread_create(&tid[i],NULL,busprobe,&b[i]))==0)
+			busprobe(&b[i]);
+	}
+	for(i=0;i<n;i++)if(thr[i])pthread_join(tid[i],NULL);
+
+	for(i=0;i<n;i++)if(b[i].rtc==1)
+	{
+		if(!ctlstate(b[i].bus,&st))
+		{
+			fprintf(stderr,"Stop the SHM master clock daemon "
+				"first.\n");
+			return -1;
+		}
+		if((fd=ds3231_open(b[i].bus))==-1)continue;
+		b[i].pps=ppsmatch(fd,pps,np);
+		close(fd);
+	}
+
+	for(i=0;i<n;i++)
+	{
+		printf("/dev/i2c-%d:",b[i].bus);
+		if(b[i].rtc==1)
+		{
+			printf(" DS3231");
+			if(b[i].pps!=-1)printf(" (/dev/pps%d)",b[i].pps);
+			else printf(" (no PPS device)");
+		}
+		else if(b[i].rtc==-1)printf(" 0x68 bound to kernel driver");
+		for(j=0;j<8;j++)if(b[i].eeprom&(1<<j))
+			printf(" EEPROM 0x%02x",0x50+j);
+		printf("\n");
+		if(!saved&&b[i].rtc==1&&b[i].pps!=-1)
+		{
+			if(confsave(b[i].bus,b[i].pps))
+				fprintf(stderr,"Can't save %s.\n",CONFFILE);
+			else printf("Saved -i %d -c %d as default.\n",
+				b[i].bus,b[i].pps);
+			saved=1;
+		}
+	}
+
+	return saved?0:-1;
+}
+
 static int cb(int current,int total,void *param)
 {
 	int remain=total-current;
@@ -501,6 +2866,49 @@ static int cb(int current,int total,void *param)
 	return 0;
 }
 
+static int lcmp(const void *p1,const void *p2)
+{
+	long v1=*((long *)p1);
+	long v2=*((long *)p2);
+
+	return v1<v2?-1:(v1>v2?1:0);
+}
+
+static void prtlatency(long *lat,int n,int missed)
+{
+	int i;
+	int j;
+	int cnt;
+	long lim;
+	long long sum;
+
+	qsort(lat,n,sizeof(long),lcmp);
+	for(sum=0,i=0;i<n;i++)sum+=lat[i];
+
+	printf("Wake latency over %d edges (%d missed):\n",n,missed);
+	printf("min %ldus avg %lldus max %ldus\n",lat[0]/1000,sum/n/1000,
+		lat[n-1]/1000);
+	printf("50%% %ldus 90%% %ldus 99%% %ldus 99.9%% %ldus\n",
+		lat[n/2]/1000,lat[(n*9)/10]/1000,lat[(n*99)/100]/1000,
+		lat[(int)((n*999LL)/1000)]/1000);
+
+	for(i=0,lim=1000;i<n;lim<<=1)
+	{
+		for(cnt=0,j=i;j<n&&lat[j]<lim;j++)cnt++;
+		if(cnt||i)printf("<%7ldus: %d\n",lim/1000,cnt);
+		i=j;
+	}
+}
+
+static void prtadev(struct adevpt *pt,int n)
+{
+	int i;
+
+	printf("     tau        adev        mdev   samples\n");
+	for(i=0;i<n;i++)printf("%8.0f %11.3e %11.3e %9llu\n",pt[i].tau,
+		pt[i].adev,pt[i].mdev,pt[i].n);
+}
+
 static void usage(void)
 {
 fprintf(stderr,
@@ -509,16 +2917,26 @@ fprintf(stderr,
 "Usage:\n"
 "\n"
 "rtctool -h\n"
-"rtctool [-i <i2cid>] -t\n"
-"rtctool [-i <i2cid>] [-R priority] -s|-S\n"
-"rtctool [-i <i2cid>] [-R priority] [-c <ppsid>] -r\n"
+"rtctool [-i <i2cid>|-K <rtcid>] -t\n"
+"rtctool [-i <i2cid>|-K <rtcid>] [-R priority] [-c <ppsid> -O <usec>] -s|-S\n"
+"rtctool [-i <i2cid>|-K <rtcid>] [-R priority] [-c <ppsid>] [-q] -r\n"
 "rtctool [-i <i2cid>] -a\n"
 "rtctool [-i <i2cid>] -A value\n"
 "rtctool [-i <i2cid>] -p\n"
 "rtctool [-i <i2cid>] -P value\n"
-"rtctool [-i <i2cid>] [-R priority] [-c <ppsid>] -e\n"
-"rtctool [-i <i2cid>] [-R priority] [-c <ppsid>] [-n <ntpid] [-b] -d\n"
+"rtctool [-i <i2cid>] [-R priority] [-c <ppsid>] [-D] -e\n"
+"rtctool [-i <i2cid>] [-R priority] [-c <ppsid>] -E <min>,<max>\n"
+"rtctool [-i <i2cid>] [-R priority] [-c <ppsid>] [-n <ntpid] [-D] [-o <file>]\n"
+"        [-N <port> [-Y <stratum>]] [-H <secs>] [-X <file>] [-j] [-b] -d\n"
+"rtctool [-i <i2cid> [-c <ppsid>]|-K <rtcid>] -z\n"
 "rtctool [-i <i2cid>] -T\n"
+"rtctool [-i <i2cid>] -v\n"
+"rtctool [-i <i2cid>] -M\n"
+"rtctool -I\n"
+"rtctool [-R priority] [-c <ppsid>] -L edges\n"
+"rtctool [-i <i2cid>] [-R priority] [-G <chip>] -g <line> [-w <secs>] -f rate\n"
+"\n"
+"All operations using -R additionally accept [-F] [-m] [-k <cpu>].\n"
 "\n"
 "-h    this help text\n"
 "-t    print rtc time\n"
@@ -530,13 +2948,47 @@ fprintf(stderr,
 "-p    print PPS output status\n"
 "-P    enable/disable PPS output (1=enable, 0=disable)\n"
 "-e    estimate ageing value (requires good NTP sync and takes 30 minutes)\n"
+"-E    measure the ageing sensitivity at the current temperature stepping\n"
+"      the ageing value from min to max (requires good NTP sync and takes\n"
+"      up to 22 minutes), the result is used by -f\n"
 "-d    run as SHM master clock daemon (gpsd replacement for chrony)\n"
+"-z    record the RTC offset at shutdown, -s with -O then learns the drift\n"
+"      while powered off and -r and -j correct the RTC time accordingly\n"
 "-T    print chip temperature\n"
-"-i    i2c bus number, default 1, range 0-1\n"
-"-c    pps device number, default 0, range 0-3\n"
+"-v    print Allan deviation from running daemon\n"
+"-M    print OpenMetrics text from running daemon\n"
+"-L    PPS wake latency self-test over the given number of edges\n"
+"-f    measure frequency error at 1024, 4096 or 8192Hz SQW rate\n"
+"-I    discover DS3231, EEPROM and PPS devices and save the defaults\n"
+"-i    i2c bus number, default 1 or as discovered, range 0-255\n"
+"-c    pps device number, default 0 or as discovered, range 0-255\n"
+"      (the discovered pair is only used as a whole, a single -i or -c\n"
+"      differing from it requires the other option as well)\n"
 "-n    ntp shared memory id, default 2, range 0-9\n"
 "-R    set realtime priority (default 99)\n"
-"-b    daemonize and run in background\n");
+"-F    use SCHED_FIFO instead of SCHED_RR\n"
+"-m    lock memory, prefault stack and minimize timer slack\n"
+"-k    pin to the given cpu\n"
+"-g    gpio line connected to SQW for -f\n"
+"-G    gpio chip number for -f, default 0\n"
+"-w    measurement time for -f in seconds, default 64, range 1-3600\n"
+"-b    daemonize and run in background\n"
+"-D    capture both PPS edges (requires clear edge capture, see HOWTO)\n"
+"-o    record all edges to the given binary trace file (see rtctrace)\n"
+"-N    serve NTP on the given UDP port from the RTC (e.g. 123)\n"
+"-Y    stratum served by -N, default 12, range 1-15\n"
+"-q    for -r set the time from a single RTC read without waiting for PPS\n"
+"      (nothing is done if the system time is synchronised)\n"
+"-j    for -d step the system time to the RTC at the first clean PPS edge\n"
+"      (ignored if the system time is synchronised)\n"
+"-H    for -d publish Kalman filtered samples and keep publishing predicted\n"
+"      samples for up to the given seconds of PPS loss (1-86400)\n"
+"-O    for -s/-S only write if the RTC offset exceeds the given microseconds\n"
+"      (now or within the next hour, judging from the drift since the last\n"
+"      write as stored in " DRIFTDIR ")\n"
+"-X    for -d write OpenMetrics text to the given file every 15 seconds\n"
+"-K    for -t, -s, -S, -r and -z use /dev/rtc<rtcid> of the kernel driver instead\n"
+"      of i2c, the second rollover is taken from the update interrupt\n");
 exit(1);
 }
 
@@ -551,14 +3003,63 @@ int main(int argc,char *argv[])
 	int rtlvl=0;
 	int bg=0;
 	int rel=0;
+	int policy=SCHED_RR;
+	int lock=0;
+	int cpu=-1;
+	int dual=0;
+	int chip=0;
+	int line=-1;
+	int secs=64;
+	int rate=0;
+	int port=0;
+	int stratum=NTP_STRATUM;
+	long gate=0;
+	int quick=0;
+	int jump=0;
+	int hold=0;
+	int rtcid=-1;
+	int key;
+	int iset=0;
+	int cset=0;
+	int ci2c;
+	int cpps;
+	int mode;
+	int cur;
+	int smin=0;
+	int smax=0;
+	int temp;
+	int measured;
+	int sage[SENS_POINTS];
+	double sppm[SENS_POINTS];
+	double sens;
+	struct linfit fit;
+	char *trace=NULL;
+	char *metrics=NULL;
+	int missed;
 	int c;
 	int fd1;
 	int fd2;
+	time_t t;
+	time_t wt;
+	long long off;
+	long long base;
+	long long pred;
+	long long corr;
+	double drift;
+	long *lat;
+	long clroff;
+	struct adev *adev;
+	struct adevpt pt[ADEV_LEVELS];
+	struct ctlrpy rpy;
+	unsigned long edges;
+	unsigned long lost;
+	double ppm;
 	struct tm datim;
-	struct sched_param s;
+	struct shmcfg cfg;
+	struct ctlstate st;
 	char bfr[32];
 
-	while((c=getopt(argc,argv,"htsSraA:pP:edTi:c:n:bR:"))!=-1)switch(c)
+	while((c=getopt(argc,argv,"htsSraA:pP:eE:dzTvi:c:n:bR:FmL:k:Df:g:G:w:o:N:Y:O:qjH:K:MX:I"))!=-1)switch(c)
 	{
 	case 't':
 		if(op!=-1)usage();
@@ -614,25 +3115,59 @@ int main(int argc,char *argv[])
 		rt=1;
 		break;
 
+	case 'E':
+		if(op!=-1)usage();
+		op=15;
+		rt=1;
+		if(sscanf(optarg,"%d,%d",&smin,&smax)!=2)usage();
+		if(smin<-127||smax>127||smin>=smax)usage();
+		break;
+
 	case 'd':
 		if(op!=-1)usage();
 		op=8;
 		rt=1;
 		break;
 
+	case 'z':
+		if(op!=-1)usage();
+		op=16;
+		break;
+
 	case 'T':
 		if(op!=-1)usage();
 		op=9;
 		break;
 
+	case 'v':
+		if(op!=-1)usage();
+		op=12;
+		break;
+
+	case 'M':
+		if(op!=-1)usage();
+		op=13;
+		break;
+
+	case 'I':
+		if(op!=-1)usage();
+		op=14;
+		break;
+
+	case 'X':
+		metrics=optarg;
+		break;
+
 	case 'i':
 		i2c=atoi(optarg);
-		if(i2c<0||i2c>1)usage();
+		if(i2c<0||i2c>255)usage();
+		iset=1;
 		break;
 
 	case 'c':
 		pps=atoi(optarg);
-		if(pps<0||pps>3)usage();
+		if(pps<0||pps>255)usage();
+		cset=1;
 		break;
 
 	case 'n':
@@ -649,64 +3184,311 @@ int main(int argc,char *argv[])
 		if(rtlvl<1||rtlvl>sched_get_priority_max(SCHED_RR))usage();
 		break;
 
+	case 'F':
+		policy=SCHED_FIFO;
+		break;
+
+	case 'D':
+		dual=1;
+		break;
+
+	case 'o':
+		trace=optarg;
+		break;
+
+	case 'N':
+		port=atoi(optarg);
+		if(port<1||port>65535)usage();
+		break;
+
+	case 'Y':
+		stratum=atoi(optarg);
+		if(stratum<1||stratum>15)usage();
+		break;
+
+	case 'q':
+		quick=1;
+		break;
+
+	case 'K':
+		rtcid=atoi(optarg);
+		if(rtcid<0||rtcid>255)usage();
+		break;
+
+	case 'j':
+		jump=1;
+		break;
+
+	case 'H':
+		hold=atoi(optarg);
+		if(hold<1||hold>86400)usage();
+		break;
+
+	case 'O':
+		gate=atol(optarg);
+		if(gate<1||gate>1000000)usage();
+		gate*=1000;
+		break;
+
+	case 'f':
+		if(op!=-1)usage();
+		op=11;
+		rt=1;
+		switch((rate=atoi(optarg)))
+		{
+		case 1024:
+			val=1;
+			break;
+		case 4096:
+			val=2;
+			break;
+		case 8192:
+			val=3;
+			break;
+		default:usage();
+		}
+		break;
+
+	case 'g':
+		line=atoi(optarg);
+		if(line<0||line>=1024)usage();
+		break;
+
+	case 'G':
+		chip=atoi(optarg);
+		if(chip<0||chip>255)usage();
+		break;
+
+	case 'w':
+		secs=atoi(optarg);
+		if(secs<1||secs>SQW_MAXTIME)usage();
+		break;
+
+	case 'm':
+		lock=1;
+		break;
+
+	case 'k':
+		cpu=atoi(optarg);
+		if(cpu<0||cpu>=CPU_SETSIZE)usage();
+		break;
+
+	case 'L':
+		if(op!=-1)usage();
+		op=10;
+		rt=1;
+		val=atoi(optarg);
+		if(val<1||val>LAT_MAX)usage();
+		break;
+
 	case 'h':
 	default:usage();
 	}
 
 	if(op==-1)usage();
+	if(op==14&&(iset||cset))usage();
+	if(op!=14&&(!iset||!cset)&&!confload(&ci2c,&cpps))
+	{
+		if(!iset&&!cset)
+		{
+			i2c=ci2c;
+			pps=cpps;
+		}
+		else if(iset&&i2c==ci2c)pps=cpps;
+		else if(cset&&pps==cpps)i2c=ci2c;
+		else
+		{
+			fprintf(stderr,"Discovered defaults are i2c bus %d with "
+				"pps device %d, specify both -i and -c.\n",
+				ci2c,cpps);
+			return 1;
+		}
+	}
 	if(bg&&op!=8)usage();
+	if(dual&&op!=7&&op!=8)usage();
+	if(op==11&&line==-1)usage();
+	if(trace&&op!=8)usage();
+	if(port&&op!=8)usage();
+	if(stratum!=NTP_STRATUM&&!port)usage();
+	if(gate&&op!=1)usage();
+	if(quick&&op!=2)usage();
+	if(rtcid!=-1&&op!=0&&op!=1&&op!=2&&op!=16)usage();
+	if(jump&&op!=8)usage();
+	if(hold&&op!=8)usage();
+	if(metrics&&op!=8)usage();
+	key=rtcid!=-1?RTCKEY+rtcid:i2c;
+	if(op==1||op==2||op==8)i2cprio=I2CARB_CRIT;
+	if(!rt&&(policy!=SCHED_RR||lock||cpu!=-1))usage();
 
 	if(rt)
 	{
-		if(rtlvl)s.sched_priority=rtlvl;
-		else s.sched_priority=sched_get_priority_max(SCHED_RR);
-		if(sched_setscheduler(0,SCHED_RR,&s))
+		if(rtsetup(policy,rtlvl,cpu))
 		{
 			fprintf(stderr,"Can't set realtime priority.\n");
 			return 1;
 		}
+		if(lock&&!(op==8&&bg))if(rtlock())
+		{
+			fprintf(stderr,"Can't lock memory.\n");
+			return 1;
+		}
 	}
 
 	switch(op)
 	{
-	case 0:	if((fd1=ds3231_open(i2c))==-1)
+	case 0:	if(rtcid!=-1)
+		{
+			if((fd1=rtcdev_open(rtcid))==-1)
+			{
+				fprintf(stderr,"Can't access /dev/rtc%d\n",rtcid);
+				return 1;
+			}
+			if(rtcdev_read_time(fd1,&t))
+			{
+				fprintf(stderr,"Can't read RTC time.\n");
+				close(fd1);
+				return 1;
+			}
+			close(fd1);
+			goto prttime;
+		}
+		if(!ctlstate(i2c,&st))
+		{
+			t=ctlrtctime(&st);
+			goto prttime;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
 		{
 			fprintf(stderr,"Can't access DS3231 device.\n");
 			return 1;
 		}
-		if(ds3231_read_time(fd1,&datim))
+		if(ds3231_read_time(fd1,&t))
 		{
 			fprintf(stderr,"Can't read DS3231 time.\n");
 			close(fd1);
 			return 1;
 		}
+		close(fd1);
+prttime:	gmtime_r(&t,&datim);
 		strftime(bfr,sizeof(bfr),"%a %F %T",&datim);
 		printf("%s\n",bfr);
-		close(fd1);
 		break;
 
-	case 1:	if((fd1=ds3231_open(i2c))==-1)
+	case 1:	if(rtcid!=-1)fd1=rtcdev_open(rtcid);
+		else fd1=ds3231_open(i2c);
+		if(fd1==-1)
 		{
 			fprintf(stderr,"Can't access DS3231 device.\n");
 			return 1;
 		}
-		if(ds3231_systohc(fd1,rel))
+		fd2=-1;
+		if(gate)
+		{
+			if(rtcid!=-1)val=rtcdev_offset(fd1,&off);
+			else if((fd2=ppsopen(pps,0))==-1)val=-1;
+			else val=ds3231_offset(fd1,fd2,&off);
+			if(val)
+			{
+				fprintf(stderr,"Can't measure DS3231 offset.\n");
+				if(fd2!=-1)close(fd2);
+				close(fd1);
+				return 1;
+			}
+			offlearn(key,&off,rtcid==-1&&!ctlstate(i2c,&st)&&
+				st.freqok?&st.kffreq:NULL);
+			t=time(NULL);
+			if(!driftload(key,&wt,&base)&&t>wt)
+				drift=(double)(off-base)/(t-wt);
+			else drift=0;
+			pred=off+(long long)(drift*GATE_CHECK);
+			if(llabs(off)<gate&&llabs(pred)<gate)
+			{
+				printf("RTC offset %+.3fms, drift %+.3fppm",
+					off/1e6,drift/1e3);
+				if(drift)printf(", next write in %.1fh",
+					((drift>0?gate:-gate)-off)/drift/3600);
+				printf(", write skipped\n");
+				if(fd2!=-1)close(fd2);
+				close(fd1);
+				break;
+			}
+		}
+		if(rtcid!=-1)val=rtcdev_systohc(fd1,rel);
+		else if(!ctlstate(i2c,&st))val=ctlsetrtc(i2c,rel);
+		else val=ds3231_systohc(fd1,rel,0);
+		if(val)
 		{
 			fprintf(stderr,"Can't set DS3231 time from system "
 				"time.\n");
+			if(fd2!=-1)close(fd2);
 			close(fd1);
 			return 1;
 		}
+		driftclear(key);
+		if(gate)
+		{
+			if(rtcid!=-1)
+			{
+				if(!(val=rtcdev_offset(fd1,&off)))
+					val=rtcdev_offset(fd1,&off);
+			}
+			else if(!(val=ds3231_offset(fd1,fd2,&off)))
+				val=ds3231_offset(fd1,fd2,&off);
+			if(!val)driftsave(key,time(NULL),off);
+			if(fd2!=-1)close(fd2);
+		}
+		else offlearn(key,NULL,NULL);
 		close(fd1);
 		break;
 
-	case 2:	if((fd1=ds3231_open(i2c))==-1)
+	case 2:	if(quick&&clksynced())
+		{
+			printf("System time is synchronised, not set.\n");
+			break;
+		}
+		if(rtcid!=-1)
+		{
+			if((fd1=rtcdev_open(rtcid))==-1)
+			{
+				fprintf(stderr,"Can't access /dev/rtc%d\n",rtcid);
+				return 1;
+			}
+			if(rtcdev_read_time(fd1,&t)||offpredict(key,t,&corr))
+				corr=0;
+			if(corr)printf("Powered-off drift correction: "
+				"%+.3fms\n",corr/1e6);
+			if(rtcdev_hctosys(fd1,quick,corr))
+			{
+				fprintf(stderr,"Can't set system time from RTC "
+					"time.\n");
+				close(fd1);
+				return 1;
+			}
+			close(fd1);
+			break;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
 		{
 			fprintf(stderr,"Can't access DS3231 device.\n");
 			return 1;
 		}
-		if((fd2=ppsopen(pps))==-1)goto guess;
-		if(ds3231_hctosys_pps(fd1,fd2))
+		if(ds3231_read_time(fd1,&t)||offpredict(key,t,&corr))corr=0;
+		if(corr)printf("Powered-off drift correction: %+.3fms\n",
+			corr/1e6);
+		if(quick)
+		{
+			if(ds3231_hctosys_coarse(fd1,corr))
+			{
+				fprintf(stderr,"Can't set system time from "
+					"DS3231 time.\n");
+				close(fd1);
+				return 1;
+			}
+			close(fd1);
+			break;
+		}
+		if((fd2=ppsopen(pps,0))==-1)goto guess;
+		if(ds3231_hctosys_pps(fd1,fd2,corr))
 		{
 			close(fd2);
 			goto guess;
@@ -717,7 +3499,7 @@ int main(int argc,char *argv[])
 
 guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 			"failed, guessing now...\n");
-		if(ds3231_hctosys_guessed(fd1))
+		if(ds3231_hctosys_guessed(fd1,corr))
 		{
 			fprintf(stderr,"Can't set system time from DS3231 "
 				"time.\n");
@@ -727,7 +3509,12 @@ guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 		close(fd1);
 		break;
 
-	case 3:	if((fd1=ds3231_open(i2c))==-1)
+	case 3:	if(!ctlstate(i2c,&st))
+		{
+			val=st.ageing;
+			goto prtageing;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
 		{
 			fprintf(stderr,"Can't access DS3231 device.\n");
 			return 1;
@@ -738,8 +3525,8 @@ guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 			close(fd1);
 			return 1;
 		}
-		printf("Ageing value: %d\n",val);
 		close(fd1);
+prtageing:	printf("Ageing value: %d\n",val);
 		break;
 
 	case 4:	if((fd1=ds3231_open(i2c))==-1)
@@ -754,14 +3541,23 @@ guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 			return 1;
 		}
 		close(fd1);
+		if(agesave(i2c,val))
+			fprintf(stderr,"Can't record ageing history.\n");
 		break;
 
-	case 5:	if((fd1=ds3231_open(i2c))==-1)
+	case 5:	if(!ctlstate(i2c,&st))
+		{
+			val=st.pps;
+			goto prtpps;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
 		{
 			fprintf(stderr,"Can't access DS3231 device.\n");
 			return 1;
 		}
-		switch(ds3231_pps(fd1,-1))
+		val=ds3231_pps(fd1,-1);
+		close(fd1);
+prtpps:		switch(val)
 		{
 		case 0:	printf("PPS output on SQW pin disabled.\n");
 			break;
@@ -770,10 +3566,8 @@ guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 			break;
 
 		case -1:fprintf(stderr,"Can't read DS3231 SQW status.\n");
-			close(fd1);
 			return 1;
 		}
-		close(fd1);
 		break;
 
 	case 6:	if((fd1=ds3231_open(i2c))==-1)
@@ -796,25 +3590,54 @@ guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 			return 1;
 		
 		}
-		if((fd2=ppsopen(pps))==-1)
+		if((fd2=ppsopen(pps,dual))==-1)
 		{
 			fprintf(stderr,"Can't access /dev/pps%d\n",pps);
 			close(fd1);
 			return 1;
 		}
-		if(ds3231_estimate_calibration(fd1,fd2,256,&val,cb,NULL))
+		if(!(adev=malloc(sizeof(struct adev))))
+		{
+			fprintf(stderr,"Out of memory.\n");
+			close(fd2);
+			close(fd1);
+			return 1;
+		}
+		adev_init(adev,1.0);
+		agesave(i2c,AGE_SWEEP);
+		if(ds3231_estimate_calibration(fd1,fd2,256,&val,
+			dual?&clroff:NULL,adev,cb,NULL))
 		{
 			fprintf(stderr,"DS3231 ageing estimation failed.\n");
+			if(!ds3231_get_ageing(fd1,&val))agesave(i2c,val);
+			free(adev);
 			close(fd2);
 			close(fd1);
 			return 1;
 		}
+		if(agesave(i2c,val))
+			fprintf(stderr,"Can't record ageing history.\n");
 		printf("Estimated ageing value: %d\n",val);
+		if(dual)printf("Clear edge offset: %ldns\n",clroff);
+		prtadev(pt,adev_get(adev,pt));
+		free(adev);
 		close(fd2);
 		close(fd1);
 		break;
 
-	case 8:	if(shmrunner(i2c,pps,shmid,bg))
+	case 8:	cfg.i2cid=i2c;
+		cfg.ppsid=pps;
+		cfg.ntpid=shmid;
+		cfg.bg=bg;
+		cfg.lock=lock;
+		cfg.jump=jump;
+		cfg.dual=dual;
+		cfg.trace=trace;
+		cfg.ntpport=port;
+		cfg.stratum=stratum;
+		cfg.hold=hold;
+		cfg.metrics=metrics;
+		if(shmrunner(&cfg))
 		{
 			fprintf(stderr,"Failed to start SHM master clock "
 				"daemon\n");
@@ -822,7 +3645,12 @@ guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 		}
 		break;
 
-	case 9:	if((fd1=ds3231_open(i2c))==-1)
+	case 9:	if(!ctlstate(i2c,&st))
+		{
+			val=st.temp;
+			goto prttemp;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
 		{
 			fprintf(stderr,"Can't access DS3231 device.\n");
 			return 1;
@@ -833,13 +3661,238 @@ guess:		fprintf(stderr,"Warning: Using PPS for precise transfer "
 			close(fd1);
 			return 1;
 		}
-		if(val<0)
+		close(fd1);
+prttemp:	if(val<0)
 		{
 			val=-val;
 			printf("Temperature: -%d.%02dC\n",val/100,val%100);
 		}
 		else printf("Temperature: %d.%02dC\n",val/100,val%100);
+		break;
+
+	case 10:if(!(lat=malloc(val*sizeof(long))))
+		{
+			fprintf(stderr,"Out of memory.\n");
+			return 1;
+		}
+		if((fd2=ppsopen(pps,0))==-1)
+		{
+			fprintf(stderr,"Can't access /dev/pps%d\n",pps);
+			free(lat);
+			return 1;
+		}
+		if(ppslatency(fd2,val,lat,&missed,cb,NULL))
+		{
+			fprintf(stderr,"PPS wake latency self-test failed.\n");
+			close(fd2);
+			free(lat);
+			return 1;
+		}
+		close(fd2);
+		prtlatency(lat,val,missed);
+		free(lat);
+		break;
+
+	case 11:if(!ctlstate(i2c,&st))
+		{
+			fprintf(stderr,"Stop the SHM master clock daemon first.\n");
+			return 1;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
+		{
+			fprintf(stderr,"Can't access DS3231 device.\n");
+			return 1;
+		}
+		if((mode=ds3231_pps(fd1,-1))==-1||ds3231_get_ageing(fd1,&cur))
+		{
+			fprintf(stderr,"Can't read DS3231 config.\n");
+			close(fd1);
+			return 1;
+		}
+		if((fd2=gpioopen(chip,line))==-1)
+		{
+			fprintf(stderr,"Can't access gpio %d of /dev/gpiochip%d\n",
+				line,chip);
+			close(fd1);
+			return 1;
+		}
+		if(ds3231_sqw(fd1,val))
+		{
+			fprintf(stderr,"Can't write DS3231 SQW config.\n");
+			goto sqwfail;
+		}
+		if(sqwmeasure(fd2,rate,secs,&ppm,&edges,&lost,cb,NULL))
+		{
+			fprintf(stderr,"SQW frequency measurement failed.\n");
+			goto sqwfail;
+		}
+		close(fd2);
+		if(ds3231_pps(fd1,mode))
+		{
+			fprintf(stderr,"Can't restore DS3231 SQW config.\n");
+			close(fd1);
+			return 1;
+		}
+		measured=0;
+		sens=SENS_NOMINAL;
+		if(!ds3231_get_temp(fd1,&temp))sens=sensget(i2c,temp,&measured);
+		close(fd1);
+		val=cur-(int)(ppm/sens+(ppm/sens<0?-0.5:0.5));
+		if(val<-127)val=-127;
+		if(val>127)val=127;
+		printf("Frequency error: %+.4fppm (%lu edges, %lu missed)\n",
+			ppm,edges,lost);
+		printf("Ageing sensitivity: %.4fppm per step (%s)\n",sens,
+			measured?"measured":"nominal");
+		printf("Estimated ageing value: %d\n",val);
+		break;
+
+sqwfail:	close(fd2);
+		ds3231_pps(fd1,mode);
+		close(fd1);
+		return 1;
+
+	case 12:if(ctlquery(i2c,CTL_ADEV,0,&rpy))
+		{
+			fprintf(stderr,"Can't query SHM master clock daemon.\n");
+			return 1;
+		}
+		prtadev(rpy.u.adev.pt,rpy.u.adev.n);
+		if(ctlstate(i2c,&st))break;
+		printf("TCXO retrims: %lu, last step: %+.4fppm\n",
+			st.tcxosteps,st.tcxostep*1e6);
+		printf("Missed edges: %lu, PPS timeouts: %lu, PPS errors: %lu, "
+			"I2C errors: %lu, reopened: %lu\n",st.missed,
+			st.timeouts,st.ppserr,st.i2cerr,st.reopen);
+		printf("RTC writes: %lu, capture ring overruns: %lu\n",
+			st.rtcsets,st.overruns);
+		printf("Filter: %+.4fppm, phase error %.0fns, outliers: %lu, "
+			"holdover samples: %lu\n",st.kffreq,st.kfsigma,
+			st.outliers,st.holdover);
+		break;
+
+	case 13:if(ctlstate(i2c,&st))
+		{
+			fprintf(stderr,"Can't query SHM master clock daemon.\n");
+			return 1;
+		}
+		if(prtmetrics(stdout,&st))return 1;
+		break;
+
+	case 14:if(discover())
+		{
+			fprintf(stderr,"No DS3231 with PPS device found.\n");
+			return 1;
+		}
+		break;
+
+	case 15:if(!ctlstate(i2c,&st))
+		{
+			fprintf(stderr,"Stop the SHM master clock daemon first.\n");
+			return 1;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
+		{
+			fprintf(stderr,"Can't access DS3231 device.\n");
+			return 1;
+		}
+		if(ds3231_get_ageing(fd1,&cur))
+		{
+			fprintf(stderr,"Can't read DS3231 ageing value.\n");
+			close(fd1);
+			return 1;
+		}
+		if((fd2=ppsopen(pps,0))==-1)
+		{
+			fprintf(stderr,"Can't access /dev/pps%d\n",pps);
+			close(fd1);
+			return 1;
+		}
+		agesave(i2c,AGE_SWEEP);
+		val=ds3231_sweep(fd1,fd2,smin,smax,sage,sppm,&temp,cb,NULL);
+		close(fd2);
+		if(ds3231_set_ageing(fd1,cur))
+		{
+			fprintf(stderr,"Can't restore DS3231 ageing value %d.\n",
+				cur);
+			close(fd1);
+			return 1;
+		}
+		close(fd1);
+		if(agesave(i2c,cur))
+			fprintf(stderr,"Can't record ageing history.\n");
+		if(val==-1)
+		{
+			fprintf(stderr,"DS3231 ageing sweep failed.\n");
+			return 1;
+		}
+		linfit_init(&fit);
+		for(c=0;c<val;c++)
+		{
+			printf("Ageing value %+4d: %+.4fppm\n",sage[c],sppm[c]);
+			linfit_add(&fit,sage[c],sppm[c]);
+		}
+		if(linfit_slope(&fit,&sens)||sens>=0||sens<-SENS_LIMIT)
+		{
+			fprintf(stderr,"Implausible ageing sensitivity, check "
+				"NTP sync.\n");
+			return 1;
+		}
+		printf("Ageing sensitivity: %.4fppm per step at %.2fC\n",
+			sens,temp/100.0);
+		if(senssave(i2c,temp,sens))
+		{
+			fprintf(stderr,"Can't save ageing sensitivity.\n");
+			return 1;
+		}
+		break;
+
+	case 16:if(rtcid!=-1)
+		{
+			if((fd1=rtcdev_open(rtcid))==-1)
+			{
+				fprintf(stderr,"Can't access /dev/rtc%d\n",rtcid);
+				return 1;
+			}
+			if(rtcdev_offset(fd1,&off))
+			{
+				fprintf(stderr,"Can't measure RTC offset.\n");
+				close(fd1);
+				return 1;
+			}
+			close(fd1);
+			goto recoff;
+		}
+		if(!ctlstate(i2c,&st))
+		{
+			off=st.offset;
+			goto recoff;
+		}
+		if((fd1=ds3231_open(i2c))==-1)
+		{
+			fprintf(stderr,"Can't access DS3231 device.\n");
+			return 1;
+		}
+		if((fd2=ppsopen(pps,0))==-1)
+		{
+			fprintf(stderr,"Can't access /dev/pps%d\n",pps);
+			close(fd1);
+			return 1;
+		}
+		if(ds3231_offset(fd1,fd2,&off))
+		{
+			fprintf(stderr,"Can't measure DS3231 offset.\n");
+			close(fd2);
+			close(fd1);
+			return 1;
+		}
+		close(fd2);
 		close(fd1);
+recoff:	if(offmark(key,off))
+		{
+			fprintf(stderr,"Can't record RTC offset.\n");
+			return 1;
+		}
 		break;
 	}
 
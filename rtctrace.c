@@ -0,0 +1,151 @@
+/*
+ * rtctrace.c
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include "rtctrace.h"
+
+static int gettm(char *str,int64_t *t)
+{
+	char *end;
+	struct tm tm;
+
+	*t=strtoll(str,&end,10);
+	if(*str&&!*end)return 0;
+	memset(&tm,0,sizeof(tm));
+	if(!(end=strptime(str,"%Y-%m-%d %H:%M:%S",&tm))||*end)return -1;
+	*t=timegm(&tm);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"Usage: rtctrace [<options>] <tracefile>\n"
+		"-s <time>   first PPS time to export (epoch or "
+		"\"YYYY-MM-DD HH:MM:SS\" UTC)\n"
+		"-e <time>   last PPS time to export (epoch or "
+		"\"YYYY-MM-DD HH:MM:SS\" UTC)\n"
+		"-n <count>  export only the most recent <count> records\n"
+		"-H          omit the CSV header line\n");
+	exit(1);
+}
+
+int main(int argc,char *argv[])
+{
+	int c;
+	int fd;
+	int hdr=1;
+	int64_t from=INT64_MIN;
+	int64_t to=INT64_MAX;
+	int64_t ofs;
+	uint64_t i;
+	uint64_t first;
+	uint64_t head;
+	uint64_t cnt=0;
+	size_t len;
+	struct stat stb;
+	struct trchdr *trc;
+	struct trcrec *ring;
+	struct trcrec r;
+
+	while((c=getopt(argc,argv,"s:e:n:H"))!=-1)switch(c)
+	{
+	case 's':
+		if(gettm(optarg,&from))usage();
+		break;
+
+	case 'e':
+		if(gettm(optarg,&to))usage();
+		break;
+
+	case 'n':
+		if((cnt=strtoull(optarg,NULL,10))<1)usage();
+		break;
+
+	case 'H':
+		hdr=0;
+		break;
+
+	default:usage();
+		break;
+	}
+
+	if(optind!=argc-1)usage();
+
+	if((fd=open(argv[optind],O_RDONLY|O_CLOEXEC))==-1)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	if(fstat(fd,&stb)||stb.st_size<sizeof(struct trchdr))
+	{
+		fprintf(stderr,"%s: not a trace file\n",argv[optind]);
+		close(fd);
+		return 1;
+	}
+	len=stb.st_size;
+	if((trc=mmap(NULL,len,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED)
+	{
+		perror("mmap");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	if(__atomic_load_n(&trc->magic,__ATOMIC_ACQUIRE)!=TRC_MAGIC||
+		trc->version!=TRC_VERSION||
+		trc->recsize!=sizeof(struct trcrec)||!trc->records||
+		len!=sizeof(struct trchdr)+
+		(size_t)trc->records*sizeof(struct trcrec))
+	{
+		fprintf(stderr,"%s: not a trace file\n",argv[optind]);
+		munmap(trc,len);
+		return 1;
+	}
+
+	ring=(struct trcrec *)(trc+1);
+	head=__atomic_load_n(&trc->head,__ATOMIC_ACQUIRE);
+	first=head>trc->records?head-trc->records:0;
+	if(cnt&&head-first>cnt)first=head-cnt;
+
+	if(hdr)printf("seq,edge,pps_sec,pps_nsec,rtc_sec,rtc_offset_ns,"
+		"i2c_ns,temp,tcxo\n");
+
+	for(i=first;i<head;i++)
+	{
+		r=ring[i%trc->records];
+		if(i+trc->records<=
+			__atomic_load_n(&trc->head,__ATOMIC_ACQUIRE))continue;
+		if(r.sec<from||r.sec>to)continue;
+		printf("%u,%s,%lld,%09u,",r.seq,
+			(r.flags&TRC_CLEAR)?"clear":"assert",(long long)r.sec,
+			r.nsec);
+		if(r.flags&TRC_RTC)
+		{
+			ofs=-(int64_t)r.rtcdelta*1000000000LL+r.nsec;
+			printf("%lld,%lld,%u,",(long long)(r.sec+r.rtcdelta),
+				(long long)ofs,r.i2cns);
+		}
+		else printf(",,,");
+		if(r.temp<0)printf("-%d.%02d,",-r.temp/100,-r.temp%100);
+		else printf("%d.%02d,",r.temp/100,r.temp%100);
+		printf("%s\n",(r.flags&TRC_STEP)?"step":
+			((r.flags&TRC_CONV)?"conv":""));
+	}
+
+	munmap(trc,len);
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * rtctrace.h
+ *
+ * (c) 2020 Andreas Steinmetz
+ *
+ * License: GPLv2 (no later version)
+ */
+
+#ifndef RTCTRACE_H_INCLUDED
+#define RTCTRACE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Binary trace file written by the rtctool daemon (-o <file>).
+ *
+ * The file consists of a header followed by a ring of fixed size records.
+ * head is the total number of records ever written, record i is stored
+ * at slot i % records. The writer fills the slot and then increments head
+ * with release semantics, so a reader has to discard records with
+ * i <= head - records after copying, as these may have been overwritten.
+ * All values are in host byte order.
+ */
+
+#define TRC_MAGIC	0x52544354
+#define TRC_VERSION	1
+#define TRC_RECORDS	262144
+
+/* record flags */
+
+#define TRC_CLEAR	0x0001	/* clear edge, else assert edge */
+#define TRC_RTC		0x0002	/* rtcdelta and i2cns are valid */
+#define TRC_TEMP	0x0004	/* temperature freshly read for this edge */
+#define TRC_CONV	0x0008	/* TCXO conversion, edge not published */
+#define TRC_STEP	0x0010	/* TCXO retrim detected at this edge */
+
+struct trchdr
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recsize;
+	uint32_t records;
+	uint64_t head;
+	uint64_t reserved[5];
+};
+
+struct trcrec
+{
+	int64_t sec;		/* PPS timestamp (CLOCK_REALTIME) */
+	uint32_t nsec;
+	uint32_t seq;		/* PPS edge count */
+	int32_t rtcdelta;	/* RTC second minus PPS timestamp second */
+	uint32_t i2cns;		/* duration of the RTC time read */
+	int16_t temp;		/* last temperature in 1/100 degrees Celsius */
+	uint16_t flags;
+	uint32_t reserved;
+};
+
+#endif